@@ -0,0 +1,98 @@
+/*
+ * WorkStealingPool.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_WORKSTEALINGPOOL_H
+#define SIMMATCH_WORKSTEALINGPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fork-join thread pool: each worker owns a deque, pops its own most recent task (LIFO, so that the
+ * recursion stays depth-first and cache-warm) and steals the oldest task from the others (FIFO, so that
+ * the thief gets the largest pending subproblem).
+ *
+ * The thread calling wait() is not blocked, but keeps on running pending tasks until its group is
+ * completed, so nested submissions from within a task never deadlock.
+ */
+class WorkStealingPool {
+public:
+    /**
+     * Set of tasks that the submitter wants to join on
+     */
+    struct TaskGroup {
+        std::atomic<size_t> pending{0};
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    /**
+     * @param nThreads  Overall number of threads running the tasks, including the one calling wait():
+     *                  therefore, nThreads-1 additional workers are started
+     */
+    explicit WorkStealingPool(size_t nThreads);
+    virtual ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    void submit(TaskGroup& group, std::function<void()> task);
+
+    /**
+     * Runs the pending tasks until all the tasks within the group are done. If any of the tasks threw
+     * an exception, the first one is rethrown here.
+     */
+    void wait(TaskGroup& group);
+
+    inline size_t size() const {
+        return queues.size();
+    }
+
+private:
+    struct Task {
+        std::function<void()> fn;
+        TaskGroup* group;
+    };
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues; ///<@ queues[0] is used by the threads outside the pool
+    std::vector<std::thread> workers;
+    std::atomic<bool> stopping;
+    std::atomic<size_t> queued;
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+
+    size_t currentQueue() const;
+    bool runOne(size_t self);
+    void workerLoop(size_t self);
+};
+
+#endif //SIMMATCH_WORKSTEALINGPOOL_H
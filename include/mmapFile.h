@@ -68,8 +68,30 @@ struct mmap_file {
  */
 void* mmapFile(std::string file, unsigned long* size, mmap_file* fd);
 
+/**
+ * Same as mmapFile, but the file is opened and mapped read-only, so that it can be shared by readers without
+ * write permissions, and any stray write faults rather than reaching the file
+ */
+const void* mmapFileReadOnly(std::string file, unsigned long* size, mmap_file* fd);
+
 void mmapClose(void* ptr, mmap_file* fd);
 
+/**
+ * Expected access to a memory-mapped range, as passed to mmapAdvise
+ */
+enum mmap_advice {
+    MMAP_NORMAL,        ///<@ the kernel's default readahead
+    MMAP_RANDOM,        ///<@ no readahead: each fault only reads the missing page
+    MMAP_SEQUENTIAL,    ///<@ aggressive readahead, and the pages read may be dropped soon after
+    MMAP_WILLNEED       ///<@ the pages are read asynchronously, without waiting for them
+};
+
+/**
+ * Gives the kernel a hint on how the range, not necessarily page-aligned, is going to be accessed. The hint
+ * is ignored where not supported (e.g. on Windows)
+ */
+void mmapAdvise(const void* ptr, unsigned long len, mmap_advice advice);
+
 
 size_t availableMemory();
 
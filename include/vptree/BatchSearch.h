@@ -0,0 +1,68 @@
+/*
+ * BatchSearch.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_BATCHSEARCH_H
+#define SIMMATCH_BATCHSEARCH_H
+
+#include "DiskVP.h"
+
+/**
+ * Top-k search of many queries at once. The queries are first sorted by the Morton code of their distances
+ * from the topmost vantage points, so that consecutive queries descend similar paths and touch the same pages.
+ * Then, each block of blockSize consecutive queries traverses the tree together: each node is visited once
+ * for all the queries of the block that did not prune it, and its vector is compared with all of them by a
+ * single one-vs-many kernel, which also serves the leaf buckets. The blocks run over a work-stealing pool.
+ *
+ * The results are the same as TopKSearch's for each query: only the order of the visit changes. The search
+ * always runs over the fp32 vectors.
+ */
+struct BatchTopKSearch {
+    static constexpr size_t MAX_BLOCK = 64;   ///<@ the queries of a block are tracked by a 64-bit mask
+
+    const DiskVP* vp;
+    size_t k;
+    size_t threads;
+    size_t blockSize;                   ///<@ queries traversing the tree together, at most MAX_BLOCK
+    bool reorder;                       ///<@ whether the queries are sorted by locality first
+    size_t nodesVisited;                ///<@ nodes and bucket entries visited by the last run, once per block
+
+    BatchTopKSearch(const DiskVP* vp, size_t k, size_t threads = 1, size_t blockSize = 16) :
+            vp{vp}, k{k}, threads{std::max((size_t)1, threads)},
+            blockSize{std::clamp(blockSize, (size_t)1, MAX_BLOCK)}, reorder{true}, nodesVisited{0} {}
+
+    /**
+     * @param queries   n queries of dimension vp->d, contiguously stored in row-major order
+     * @return The top-k list of each query, sorted by increasing distance, in the order of the queries
+     */
+    std::vector<std::vector<DiskVP::HeapItem>> run(const float* queries, size_t n);
+
+    /**
+     * Order in which the queries are run: by the Morton code of their distances from the root vantage point
+     * and its children, each quantized to 21 bits
+     */
+    std::vector<size_t> locality_order(const float* queries, size_t n) const;
+
+private:
+    struct Block;
+    size_t run_block(const float* queries, const size_t* order, size_t count,
+                     std::vector<std::vector<DiskVP::HeapItem>>& results) const;
+};
+
+#endif //SIMMATCH_BATCHSEARCH_H
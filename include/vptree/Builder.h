@@ -27,6 +27,7 @@
 #define SIMMATCH_BUILDER_H
 
 #include "DiskVP.h"
+#include "FAISSBatch.h"
 
 static inline float squared_distance(size_t n, float* l, float* r) {
     float s = 0;
@@ -43,24 +44,152 @@ class Builder {
     DiskVP b1;
     DiskVP b2;
     std::string sorted;
+    size_t memoryBudget;
+    bool inPlace;
+    bool vebLayout;
+    bool splitTopology;
+    VectorCodec quantization;
+    unsigned int pqSubspaces;
+    size_t pqTrainingSamples;
 
 public:
-    Builder(int d, const std::filesystem::path &p, int blockade=-1, VPTRee_Strategies doMedian=RANDOM_ROOT_UNBALANCED) : d(d), p(p), sorted(p.string()+"_sorted"),
+    /**
+     * @param d         Vector dimension
+     * @param p         File where the VP-tree is going to be stored
+     * @param blockade  Size of the subtrees being balanced (-1 for none)
+     * @param doMedian  Strategy for choosing the vantage points
+     * @param threads   Number of threads restructuring the tree: the resulting file does not depend on it
+     */
+    Builder(int d, const std::filesystem::path &p, int blockade=-1, VPTRee_Strategies doMedian=RANDOM_ROOT_UNBALANCED, size_t threads=1) : d(d), p(p), sorted(p.string()+"_sorted"),
                                                      b1(d, p.c_str(), squared_distance, blockade, doMedian),
-                                                     b2(d, p.string()+"_sorted", squared_distance){
+                                                     b2(d, p.string()+"_sorted", squared_distance),
+                                                     memoryBudget{availableMemory()/2}, inPlace{true}, vebLayout{false}, splitTopology{false},
+                                                     quantization{CODEC_FP32}, pqSubspaces{0}, pqTrainingSamples{65536} {
+        b1.threads = threads;
+        b1.metric = b2.metric = METRIC_EUCLIDEAN;
+    }
+
+    /**
+     * Datasets whose records exceed this size (by default, half of the physical memory) are restructured
+     * out-of-core through DiskVP::restruct_index_external
+     */
+    inline void setMemoryBudget(size_t bytes) {
+        memoryBudget = bytes;
+    }
+
+    /**
+     * Sample sizes for SAMPLED_ROOT_MAX_SPREAD: the number of candidate vantage points, and the number of
+     * elements against which the spread of each candidate is estimated
+     */
+    inline void setVantagePointSampling(size_t candidates, size_t samples) {
+        b1.vpCandidates = std::max((size_t)1, candidates);
+        b1.vpSamples = std::max((size_t)2, samples);
+    }
+
+    /**
+     * Whether the in-memory build permutes the records within the original file (default), or copies them
+     * into a second sorted file
+     */
+    inline void setInPlace(bool inPlace) {
+        this->inPlace = inPlace;
+    }
+
+    /**
+     * Subtrees with at most size elements are stored as a single leaf bucket: a contiguous run of records
+     * scanned linearly, rather than a chain of single-element nodes. Sizing the bucket to one or a few pages
+     * (e.g., 4096/DiskVP::record_size() elements per page) serves several candidates per page read.
+     */
+    inline void setLeafBucketSize(size_t size) {
+        b1.leafBucketSize = size;
+    }
 
+    /**
+     * Whether the built tree is relaid out in van Emde Boas order (see DiskVP::relayout_veb)
+     */
+    inline void setVebLayout(bool veb) {
+        vebLayout = veb;
+    }
+
+    /**
+     * Whether the built tree stores the topology apart from the vectors (see DiskVP::split_topology)
+     */
+    inline void setSplitTopology(bool split) {
+        splitTopology = split;
+    }
+
+    /**
+     * Also stores the vectors compressed with the given codec (CODEC_FP32 for none) within the _q file, over
+     * which the searches run once opened through DiskVP::openQuantized
+     */
+    inline void setQuantization(VectorCodec codec) {
+        quantization = codec;
+    }
+
+    /**
+     * Also trains a product quantizer with the given number of subspaces (0 for none), and stores the PQ codes
+     * within the _pq file, over which TopKSearch runs once opened through DiskVP::openPQ
+     */
+    inline void setProductQuantization(unsigned int subspaces, size_t trainingSamples = 65536) {
+        pqSubspaces = subspaces;
+        pqTrainingSamples = trainingSamples;
+    }
+
+    inline void setSeed(uint64_t seed) {
+        b1.seed = seed;
     }
 
     inline void write_entry_to_disk(const std::vector<float>& ptr) {
         b1.write_entry_to_disk(ptr);
     }
 
+    /**
+     * Bulk ingestion of contiguous row-major vectors (see DiskVP::write_entries_to_disk)
+     */
+    inline void write_entries_to_disk(std::span<const float> rows) {
+        b1.write_entries_to_disk(rows);
+    }
+
+    inline void write_batch_to_disk(const FAISSBatch& batch) {
+        b1.write_entries_to_disk(batch.xb, batch.nb);
+    }
+
+    inline void write_entries_from_file(const std::filesystem::path& raw) {
+        b1.write_entries_from_file(raw);
+    }
+
     inline void build() {
-        b1.restruct_index( b2);
-        std::string name1 = std::tmpnam(nullptr);
-        std::rename(p.c_str(), name1.c_str());
-        std::rename(sorted.c_str(), p.c_str());
-        unlink(name1.c_str());
+        bool copied = true;
+        if (b1.size()*b1.record_size() > memoryBudget) {
+            b1.restruct_index_external(b2, memoryBudget);
+        } else if (inPlace) {
+            b1.restruct_index_in_place();
+            b1.closeSortedFile();
+            copied = false;
+        } else {
+            b1.restruct_index( b2);
+        }
+        if (copied) {
+            std::string name1 = std::tmpnam(nullptr);
+            std::rename(p.c_str(), name1.c_str());
+            std::rename(sorted.c_str(), p.c_str());
+            unlink(name1.c_str());
+        }
+        if (vebLayout || splitTopology || (quantization != CODEC_FP32) || (pqSubspaces > 0)) {
+            DiskVP vp(d, p, squared_distance);
+            vp.seed = b1.seed;
+            vp.threads = b1.threads;
+            vp.openSortedFile();
+            if (vebLayout)
+                vp.relayout_veb();
+            if (splitTopology)
+                vp.split_topology();
+            // Last, as the codes follow the final positions
+            if (quantization != CODEC_FP32)
+                vp.quantize(quantization);
+            if (pqSubspaces > 0)
+                vp.train_pq(pqSubspaces, pqTrainingSamples);
+            vp.closeSortedFile();
+        }
     }
 
 };
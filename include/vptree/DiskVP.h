@@ -32,10 +32,18 @@
 #include <random>
 #include "mmapFile.h"
 #include "disk_vp_node_header.h"
+#include "QuantizedVectors.h"
+#include "ProductQuantizer.h"
 #include <queue>
 #include <stack>
 #include <string.h>
+#include <mutex>
+#include <span>
+#include <memory>
+#include <chrono>
+#include <iterator>
 
+class WorkStealingPool;
 
 /**
  * From Knuth's the art of computer programming
@@ -58,10 +66,33 @@ template  <typename T>  bool definitelyLessThan(T a, T b)
 enum VPTRee_Strategies {
         BALANCED_ROOT_IS_GEOMETRIC_MEDIAN,
         BALANCED_ROOT_IS_HALFWAY_BLOCKADE,
-        RANDOM_ROOT_UNBALANCED
+        RANDOM_ROOT_UNBALANCED,
+        SAMPLED_ROOT_MAX_SPREAD ///<@ Yianilos' selection: the sampled candidate whose distances to a sample have the largest variance
 
     };
 
+/**
+ * SplitMix64 generator (Steele et al.): being seeded per tree node, the vantage point selection does not
+ * depend on the order in which the subtrees are visited, and therefore the sequential and the parallel
+ * builds produce the very same file.
+ */
+struct SplitMix64 {
+    using result_type = uint64_t;
+    uint64_t state;
+
+    explicit SplitMix64(uint64_t seed) : state{seed} {}
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    inline result_type operator()() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+};
+
 struct DiskVP {
     unsigned int d;
     std::filesystem::path vptree;
@@ -73,12 +104,43 @@ struct DiskVP {
     mmap_file fileptr, idxPtr;
     char* file;
     size_t* idxFile;
+    unsigned long tombLen;
+    mmap_file tombPtr;
+    uint64_t* tombstones;             ///<@ bitmap of the deleted ids, if opened (see openTombstones)
+    size_t deadCount;                 ///<@ number of deleted ids
     bool start_to_write;
     std::function<float(size_t,float*,float*)> ker;
-    std::mt19937 rng;                 ///<@ random number generator
+    uint64_t seed;                    ///<@ seed from which each node derives its random number generator
     int blockade;
     VPTRee_Strategies doBalancedSorting;
-    float* ptrMemory;
+    size_t threads;                   ///<@ number of threads used for restructuring the tree
+    size_t parallelGrain;             ///<@ subtrees smaller than this are built sequentially within a single task
+    size_t vpCandidates;              ///<@ SAMPLED_ROOT_MAX_SPREAD: number of candidate vantage points per node
+    size_t vpSamples;                 ///<@ SAMPLED_ROOT_MAX_SPREAD: number of elements against which the spread is estimated
+    size_t leafBucketSize;            ///<@ subtrees with at most this many elements become a single leaf bucket (0 for none)
+    uint32_t version;                 ///<@ file format: DISKVP_FORMAT_VERSION, or DISKVP_LEGACY_VERSION for the old files
+    DiskVPMetric metric;              ///<@ metric recorded within the file header
+    uint32_t flags;                   ///<@ DISKVP_FLAG_* bits recorded within the file header
+    size_t dataOffset;                ///<@ offset of the first record within the file
+    size_t vectorOffset;              ///<@ offset of the vector within each record
+    size_t recordStride;              ///<@ size of each record
+    char* topology;                   ///<@ DISKVP_FLAG_SPLIT: nodes loaded in memory, or nullptr for interleaved records
+    size_t topologyLen;
+    char* vectors;                    ///<@ DISKVP_FLAG_SPLIT: first vector of the memory-mapped _vec file
+    size_t vectorStride;              ///<@ DISKVP_FLAG_SPLIT: size of each vector slot
+    unsigned long vecLen;
+    mmap_file vecPtr;
+    char* vecFile;
+    std::unique_ptr<QuantizedVectors> quantized;  ///<@ compressed vectors used by the searches, if opened (see openQuantized)
+    std::unique_ptr<ProductQuantizer> pq;         ///<@ PQ codes used by TopKSearch, if opened (see openPQ)
+    bool prefetchNodes{true};         ///<@ whether the searches prefetch the children of each node while computing its distance
+    bool willNeedNodes{false};        ///<@ cold caches: whether the searches also ask the kernel to start reading the children's
+                                      ///<@ pages. It costs a system call per child, even when the pages are resident
+    mmap_advice accessAdvice{MMAP_NORMAL};        ///<@ hint given for the mapped records and vectors once the file is opened:
+                                                  ///<@ MMAP_RANDOM only pays off when each query touches few of the pages of
+                                                  ///<@ a tree much larger than memory, as the nearby pages read ahead are
+                                                  ///<@ otherwise visited by the same query
+    std::mutex blockadeMutex;
 
     DiskVP(unsigned int d,
            const std::filesystem::path& vptree,
@@ -86,35 +148,120 @@ struct DiskVP {
            int blockade = -1,
            VPTRee_Strategies doBalancedSorting = RANDOM_ROOT_UNBALANCED) :
 
-           file{nullptr}, d(d), start_to_write{false}, vptree(vptree), idx{0}, ker{ker}, blockade{blockade},
-           doBalancedSorting{doBalancedSorting} {
-        if (doBalancedSorting != RANDOM_ROOT_UNBALANCED) {
-            ptrMemory = new float[d];
+           d(d), vptree(vptree), idx{0}, file{nullptr}, idxFile{nullptr}, tombstones{nullptr}, deadCount{0}, start_to_write{false}, ker{ker}, seed{std::mt19937::default_seed},
+           blockade{blockade}, doBalancedSorting{doBalancedSorting}, threads{1}, parallelGrain{4096},
+           vpCandidates{16}, vpSamples{64}, leafBucketSize{0}, metric{METRIC_CUSTOM}, flags{0},
+           topology{nullptr}, topologyLen{0}, vectors{nullptr}, vectorStride{0}, vecFile{nullptr} {
+        set_format(DISKVP_FORMAT_VERSION);
+    }
+
+    static inline size_t align_up(size_t n) {
+        return (n + DISKVP_ALIGNMENT - 1) / DISKVP_ALIGNMENT * DISKVP_ALIGNMENT;
+    }
+
+    /**
+     * Sets the record layout for the given format version: files are always written with the current one,
+     * while the older ones are only detected when opening old files
+     */
+    inline void set_format(uint32_t v) {
+        version = v;
+        if (v == DISKVP_LEGACY_VERSION) {
+            dataOffset = sizeof(unsigned int);
+            vectorOffset = sizeof(disk_vp_narrow_node_header);
+            recordStride = sizeof(disk_vp_narrow_node_header)+sizeof(float)*d;
         } else {
-            ptrMemory = nullptr;
+            dataOffset = sizeof(disk_vp_file_header);
+            // Both the narrow and the wide node headers fit within the first cache line
+            vectorOffset = align_up(sizeof(disk_vp_node_header));
+            recordStride = vectorOffset + align_up(sizeof(float)*d);
         }
     }
 
+    /**
+     * Uses the same layout and metric as other, so that the records can be copied as they are
+     */
+    inline void copy_format(const DiskVP& other) {
+        set_format(other.version);
+        metric = other.metric;
+    }
+
     virtual ~DiskVP() {
-        if (ptrMemory)
-            delete ptrMemory;
     }
 
     inline void start_write_to_disk() {
         if (!start_to_write) {
+            if (is_narrow())
+                throw std::runtime_error("ERROR: files are only written with 64-bit ids");
             myfile = fopen(vptree.c_str(), "w");
-            fwrite(&d, sizeof(float), 1, myfile);
+            // The count is only known when the file is finalised
+            auto header = file_header();
+            fwrite(&header, sizeof(disk_vp_file_header), 1, myfile);
             start_to_write = true;
         }
 
     }
 
+    inline disk_vp_file_header file_header() const {
+        disk_vp_file_header header;
+        memset(&header, 0, sizeof(disk_vp_file_header));
+        memcpy(header.magic, DISKVP_MAGIC, sizeof(header.magic));
+        header.version = version;
+        header.d = d;
+        header.count = idx;
+        header.metric = metric;
+        header.flags = flags;
+        header.recordSize = recordStride;
+        return header;
+    }
+
+    /**
+     * Memory-maps the file, detecting whether it uses the versioned format or the legacy one
+     */
     inline void openSortedFile(bool actual=true) {
         file = (char *) mmapFile(vptree.string(), &mmapfilelen, &fileptr);
-        if (*((unsigned int *) file) != d) {
-            throw std::runtime_error("ERROR: DIMENSIONS DO NOT MATCH");
+        if (!file) {
+            throw std::runtime_error("ERROR: CANNOT OPEN "+vptree.string());
         }
-        idx = (mmapfilelen-sizeof(unsigned int))/(sizeof(disk_vp_node_header)+sizeof(float)*d);
+        auto header = (const disk_vp_file_header*)file;
+        if ((mmapfilelen >= sizeof(disk_vp_file_header)) && (memcmp(header->magic, DISKVP_MAGIC, sizeof(header->magic)) == 0)) {
+            if ((header->version != DISKVP_FORMAT_VERSION) && (header->version != DISKVP_NARROW_VERSION)) {
+                throw std::runtime_error("ERROR: UNSUPPORTED FORMAT VERSION");
+            }
+            if (header->d != d) {
+                throw std::runtime_error("ERROR: DIMENSIONS DO NOT MATCH");
+            }
+            if ((metric != METRIC_CUSTOM) && (header->metric != METRIC_CUSTOM) && (header->metric != metric)) {
+                throw std::runtime_error("ERROR: METRICS DO NOT MATCH");
+            }
+            set_format(header->version);
+            metric = (DiskVPMetric)header->metric;
+            flags = header->flags;
+            size_t stride = is_split() ? node_size() : recordStride;
+            if (header->recordSize != stride) {
+                throw std::runtime_error("ERROR: RECORD SIZE DOES NOT MATCH");
+            }
+            idx = (mmapfilelen-dataOffset)/stride;
+            if (header->count != idx) {
+                throw std::runtime_error("ERROR: LENGTH DOES NOT MATCH");
+            }
+            if (is_split()) {
+                open_split_files();
+            } else if (is_narrow()) {
+                open_narrow_records();
+            }
+        } else {
+            if (*((unsigned int *) file) != d) {
+                throw std::runtime_error("ERROR: DIMENSIONS DO NOT MATCH");
+            }
+            set_format(DISKVP_LEGACY_VERSION);
+            flags = 0;
+            idx = (mmapfilelen-dataOffset)/recordStride;
+            open_narrow_records();
+        }
+        // Given after the topology is loaded, which reads the nodes in order
+        mmapAdvise(file, mmapfilelen, accessAdvice);
+        if (vecFile)
+            mmapAdvise(vecFile, vecLen, accessAdvice);
         if (actual) {
             std::string indexFN = vptree.string()+"_idx";
             idxFile = (size_t *) mmapFile(indexFN, &idxLen, &idxPtr);
@@ -133,9 +280,9 @@ struct DiskVP {
             out << "\t radius = " << ptr->radius << std::endl;
             if (ptr->isLeaf)
                 out << "\t leaf " << std::endl;
-            if (ptr->leftChild != std::numeric_limits<unsigned int>::max())
+            if (ptr->leftChild != NO_CHILD)
                 out << "\t leftChild = " << ptr->leftChild << std::endl;
-            if (ptr->rightChild != std::numeric_limits<unsigned int>::max())
+            if (ptr->rightChild != NO_CHILD)
                 out << "\t rightChild = " << ptr->rightChild << std::endl;
         }
     }
@@ -147,34 +294,264 @@ struct DiskVP {
         if (idxFile) {
             mmapClose(idxFile, &idxPtr);
         }
+        if (tombstones) {
+            mmapClose(tombstones, &tombPtr);
+        }
+        if (vecFile) {
+            mmapClose(vecFile, &vecPtr);
+        }
+        if (topology) {
+            munmap(topology, topologyLen);
+        }
+        quantized.reset();
+        pq.reset();
+        file = nullptr;
+        idxFile = nullptr;
+        tombstones = nullptr;
+        vecFile = vectors = topology = nullptr;
+    }
+
+    inline bool is_split() const {
+        return flags & DISKVP_FLAG_SPLIT;
+    }
+
+    /**
+     * Whether the file stores 32-bit ids and child positions: being widened in memory once opened, such a file
+     * can be searched, but neither compacted nor relaid out
+     */
+    inline bool is_narrow() const {
+        return version != DISKVP_FORMAT_VERSION;
+    }
+
+    /**
+     * Size of the node headers stored within the file
+     */
+    inline size_t node_size() const {
+        return is_narrow() ? sizeof(disk_vp_narrow_node_header) : sizeof(disk_vp_node_header);
+    }
+
+    /**
+     * Moves the vectors of the sorted file to the _vec file, leaving within the original file the topology
+     * only (see DISKVP_FLAG_SPLIT). Once opened, the topology is loaded in memory, possibly backed by huge pages,
+     * so that the traversal never faults, and the vectors are only read when a distance is computed.
+     *
+     * As records are no longer stored as a whole, the split file can be neither compacted nor relaid out.
+     */
+    void split_topology();
+
+    /**
+     * Maps the _vec file, and loads the topology from the memory-mapped sorted file
+     */
+    void open_split_files();
+
+    /**
+     * Loads the narrow node headers of the interleaved records as a wide topology, the vectors being still
+     * read from the memory-mapped file
+     */
+    void open_narrow_records();
+
+    /**
+     * Loads in memory, possibly backed by huge pages, the idx node headers starting at first every stride
+     * bytes, widening them if the file is narrow
+     */
+    void load_topology(const char* first, size_t stride);
+
+    /**
+     * Converts n narrow node headers, starting at first every stride bytes, into wide ones
+     */
+    static void widen_nodes(const char* first, size_t stride, size_t n, disk_vp_node_header* out);
+
+    /**
+     * Writes the vectors of the sorted file, in position order, to the _q file with the given codec. As the
+     * codes follow the positions, the file shall be quantized after any relayout; compact rebuilds it.
+     */
+    void quantize(VectorCodec codec);
+
+    /**
+     * Opens the _q file: from now on, the searches compute the distances over the compressed vectors
+     */
+    void openQuantized();
+
+    /**
+     * Trains the product quantizer over the vectors of the sorted file, and writes their PQ codes, in position
+     * order, to the _pq file. As for quantize, this shall follow any relayout.
+     *
+     * @param subspaces         Number of subspaces, i.e. bytes per vector
+     * @param trainingSamples   Number of vectors over which the codebooks are trained
+     */
+    void train_pq(unsigned int subspaces, size_t trainingSamples = 65536);
+
+    /**
+     * Loads the _pq file in memory: from now on, TopKSearch evaluates the candidates through the PQ codes,
+     * taking precedence over the quantized vectors
+     */
+    void openPQ();
+
+    /**
+     * Distance of the query from the vector at the given position, computed over the compressed vectors if
+     * opened, and through ker otherwise
+     */
+    inline float distance_to(size_t pos, float* query) const {
+        return quantized ? quantized->distance(pos, query) : ker(d, getPTR(pos), query);
     }
 
+    /**
+     * Id marking the slots that no longer belong to the tree after a compaction
+     */
+    static constexpr uint64_t STRANDED_SLOT = std::numeric_limits<uint64_t>::max();
+
+    /**
+     * Child position marking the absence of a child
+     */
+    static constexpr uint64_t NO_CHILD = std::numeric_limits<uint64_t>::max();
+
+    /**
+     * Entry of the _idx file of the ids removed by a compaction, whose former slots may hold other records
+     */
+    static constexpr uint64_t NO_POSITION = std::numeric_limits<uint64_t>::max();
+
+    /**
+     * Opens (or creates) the persistent bitmap of deleted ids, stored in the _tomb file alongside the sorted one
+     */
+    void openTombstones();
+
+    /**
+     * Marks the element with the given id (insertion order) as deleted: it is still used for routing the
+     * searches, but it is no longer returned
+     * @return Whether the element was not already deleted
+     */
+    bool erase(size_t id);
+
+    inline bool isDeleted(size_t id) const {
+        if (id == STRANDED_SLOT)
+            return true;
+        return tombstones && (tombstones[id / 64] & (1ULL << (id % 64)));
+    }
+
+    /**
+     * Position of the element with the given id (insertion order), which shall be neither deleted nor removed
+     */
+    inline size_t position(size_t id) const {
+        if ((id >= idx) || isDeleted(id) || (idxFile[id] == NO_POSITION))
+            throw std::runtime_error("ERROR: THE ID IS DELETED OR DOES NOT EXIST");
+        return idxFile[id];
+    }
+
+    /**
+     * Reorders the records of the sorted file in van Emde Boas order: each subtree of height h is stored as
+     * its top subtree of height h/2, followed by the bottom subtrees, recursively. Differently from preorder,
+     * where right children lie far away from their parents, each root-to-leaf path then spans
+     * O(log_B n) blocks for any block size B, page or cache line. Leaf buckets are kept contiguous.
+     *
+     * The child pointers and the _idx file are rewritten accordingly, and the layout is recorded within the
+     * file header. As subtrees no longer span contiguous ranges, compact is no longer available afterwards.
+     */
+    void relayout_veb();
+
+    inline bool is_preorder() const {
+        return !(flags & DISKVP_FLAG_VEB_LAYOUT);
+    }
+
+    /**
+     * Last position of the leaf bucket headed at pos, given the last position of its subtree in preorder
+     */
+    inline size_t bucket_last(size_t pos, const disk_vp_node_header* head, size_t subtreeLast) const {
+        return is_preorder() ? subtreeLast : pos + head->leftChild - 1;
+    }
+
+    /**
+     * Rebuilds the largest subtrees whose fraction of deleted elements exceeds threshold, so that they only
+     * contain the remaining ones. Each subtree is rebuilt in place within the positions it was occupying,
+     * which is possible as the sorted file stores each subtree in a contiguous range (preorder): the
+     * positions left over at the end of the range are marked with STRANDED_SLOT, and are no longer reachable.
+     * The _idx entries of the removed ids are set to NO_POSITION.
+     *
+     * @param threshold     Fraction of deleted elements triggering the rebuild of a subtree
+     * @param minSubtree    Subtrees with fewer positions than this are never rebuilt on their own
+     * @return Number of deleted elements removed from the tree
+     */
+    size_t compact(double threshold, size_t minSubtree = 64);
+
+    /**
+     * Restructures in memory the n records within buffer, laid out as in the file (dataOffset bytes followed by
+     * the records), with the same parameters as the current tree
+     * @return The preorder of the records within buffer, whose child pointers are relative to the first one
+     */
+    std::vector<size_t> restruct_buffer(std::vector<char>& buffer, size_t n) const;
+
     inline size_t size() const {
         return idx;
     }
 
+    /**
+     * Size of each record in the file, being the node header followed by the vector (see set_format)
+     */
+    inline size_t record_size() const {
+        return recordStride;
+    }
+
+    /**
+     * Appends a whole record (header and vector) as it is. Differently from write_entry_to_disk, the record
+     * is not tracked within index, thus not requiring memory proportional to the number of records
+     */
+    inline void write_record_to_disk(const char* record) {
+        start_write_to_disk();
+        fwrite(record, record_size(), 1, myfile);
+        idx++;
+    }
+
     inline void write_entry_to_disk(disk_vp_node_header *to_dist, float *ptr) {
         start_write_to_disk();
         fwrite(to_dist, sizeof(disk_vp_node_header), 1, myfile);
+        write_padding(vectorOffset - sizeof(disk_vp_node_header));
         fwrite(ptr, sizeof(float), d, myfile);
-        fflush(myfile);
+        write_padding(recordStride - vectorOffset - sizeof(float)*d);
         this->index.emplace_back(idx);
         idx++;
     }
 
+    inline void write_padding(size_t n) {
+        static const char zeros[DISKVP_ALIGNMENT]{};
+        if (n > 0)
+            fwrite(zeros, 1, n, myfile);
+    }
+
     inline void write_entry_to_disk(const std::vector<float>& entry) {
         start_write_to_disk();
         disk_vp_node_header to_disk;
+        // Zeroing the padding bytes too, so that the same data always produces the same file
+        memset(&to_disk, 0, sizeof(disk_vp_node_header));
         to_disk.id = idx;
         to_disk.radius = 0;
-        to_disk.leftChild = to_disk.rightChild = std::numeric_limits<unsigned int>::max();
+        to_disk.leftChild = to_disk.rightChild = NO_CHILD;
         to_disk.isLeaf = false;
         fwrite(&to_disk, sizeof(disk_vp_node_header), 1, myfile);
+        write_padding(vectorOffset - sizeof(disk_vp_node_header));
         fwrite(entry.data(), sizeof(float), d, myfile);
+        write_padding(recordStride - vectorOffset - sizeof(float)*d);
         index.emplace_back(idx);
         idx++;
     }
 
+    /**
+     * Bulk counterpart of write_entry_to_disk: the headers are prepared within a staging buffer together with
+     * the vectors, and the buffer is written in large chunks via pwrite, rather than with two stdio calls per
+     * record
+     *
+     * @param rows  n vectors of dimension d, contiguously stored in row-major order (e.g., FAISSBatch::xb)
+     * @param n     Number of vectors
+     */
+    void write_entries_to_disk(const float* rows, size_t n);
+
+    inline void write_entries_to_disk(std::span<const float> rows) {
+        write_entries_to_disk(rows.data(), rows.size() / d);
+    }
+
+    /**
+     * Bulk-loads a raw file of float vectors of dimension d stored in row-major order, by memory-mapping it
+     */
+    void write_entries_from_file(const std::filesystem::path& raw);
+
     static inline std::vector<float> space_normalization_function(float* min, float* ptr, size_t dim, float delta) {
         std::vector<float> tp;
         tp.reserve(dim);
@@ -232,19 +609,16 @@ struct DiskVP {
 
     inline void restruct_index(DiskVP& b2) {
         if (start_to_write) {
+            b2.copy_format(*this);
             finaliseFile();
-            recursive_restruct_tree(0, idx-1);
-            std::string indexFN = vptree.string()+"_idx";
+            restruct_tree();
             std::vector<size_t> indexMemory(size(), 0);
             for (size_t i = 0, N = size(); i<N; i++) {
                 auto ptr = getShuffledEntryPoint(i);
                 indexMemory[ptr->id] = i;
-                b2.write_entry_to_disk(ptr, getSPTR(i));
-            }
-            auto idxFile = fopen(indexFN.c_str(), "w");
-            for (size_t i = 0, N = size(); i<N; i++) {
-                fwrite(&indexMemory[i], sizeof(size_t), 1, idxFile);
+                b2.write_record_to_disk((const char*)ptr);
             }
+            write_index_file(indexMemory);
             if (!blockade_elements.empty()) {
                 std::vector<float> minP(d, std::numeric_limits<float>::max());
                 std::vector<float> maxP(d, std::numeric_limits<float>::max());
@@ -260,62 +634,169 @@ struct DiskVP {
                     }
                 }
             }
-            fclose(idxFile);
             b2.finaliseFile();
         }
     }
 
+    /**
+     * Same as restruct_index, but the records are permuted within the file itself by following the cycles of
+     * the permutation, rather than being copied into a second file: the peak disk usage is the dataset's, and
+     * each record is written only once
+     */
+    inline void restruct_index_in_place() {
+        if (start_to_write) {
+            finaliseFile();
+            restruct_tree();
+            std::vector<size_t> indexMemory(size(), 0);
+            for (size_t i = 0, N = size(); i<N; i++)
+                indexMemory[getShuffledEntryPoint(i)->id] = i;
+            permute_in_place();
+            write_index_file(indexMemory);
+        }
+    }
+
+    inline void restruct_tree() {
+        if (threads > 1) {
+            parallel_restruct_tree(0, idx-1);
+        } else {
+            recursive_restruct_tree(0, idx-1);
+        }
+    }
+
+    /**
+     * Writes the _idx file, mapping each id to its position within the sorted file, with a single write
+     */
+    inline void write_index_file(const std::vector<size_t>& indexMemory) const {
+        std::string indexFN = vptree.string()+"_idx";
+        auto idxFile = fopen(indexFN.c_str(), "w");
+        fwrite(indexMemory.data(), sizeof(size_t), indexMemory.size(), idxFile);
+        fclose(idxFile);
+    }
+
+    /**
+     * Moves each record index[i] to position i within the memory-mapped file, leaving index as the identity
+     */
+    void permute_in_place();
+
+    /**
+     * Beginning of the record at the given position within the file
+     */
+    inline char* record(size_t idx) const {
+        return file + dataOffset + recordStride*idx;
+    }
+
+    /**
+     * Node at the given position, being either the beginning of the record or the in-memory topology
+     */
+    inline struct disk_vp_node_header* node(size_t idx) const {
+        return (struct disk_vp_node_header*)(topology ? topology + sizeof(disk_vp_node_header)*idx : record(idx));
+    }
+
     inline struct disk_vp_node_header* getEntryPoint(size_t idx) {
         finaliseFile();
-        return (struct disk_vp_node_header*)(file + sizeof(unsigned int) + (sizeof(disk_vp_node_header) + (sizeof(float)*d))*idx);
+        return node(idx);
     }
 
     inline struct disk_vp_node_header* getEntryPoint(size_t idx) const {
 //        finaliseFile();
-        return (struct disk_vp_node_header*)(file + sizeof(unsigned int) + (sizeof(disk_vp_node_header) + (sizeof(float)*d))*idx);
+        return node(idx);
     }
 
     inline struct disk_vp_node_header* getShuffledEntryPoint(size_t idx) {
         finaliseFile();
         idx = index[idx];
-        return (struct disk_vp_node_header*)(file + sizeof(unsigned int) + (sizeof(disk_vp_node_header) + (sizeof(float)*d))*idx);
+        return node(idx);
     }
 
     inline void updateNode(size_t idx, float distance, size_t lchild,size_t rchild, bool lf=false) {
+        auto node = this->node(idx);
         if (lf)
-            *(bool*)(file + sizeof(unsigned int) + (sizeof(disk_vp_node_header) + (sizeof(float)*d))*idx+ offsetof(disk_vp_node_header, isLeaf)) = lf;
+            node->isLeaf = lf;
         if (distance != 0.0)
-            *(float*)(file + sizeof(unsigned int) + (sizeof(disk_vp_node_header) + (sizeof(float)*d))*idx+ offsetof(disk_vp_node_header, radius)) = distance;
-        if (lchild != std::numeric_limits<unsigned int>::max())
-            *(size_t*)(file + sizeof(unsigned int) + (sizeof(disk_vp_node_header) + (sizeof(float)*d))*idx+ offsetof(disk_vp_node_header, leftChild)) = lchild;
-        if (lchild != std::numeric_limits<unsigned int>::max())
-            *(size_t*)(file + sizeof(unsigned int) + (sizeof(disk_vp_node_header) + (sizeof(float)*d))*idx+ offsetof(disk_vp_node_header, rightChild)) = rchild;
+            node->radius = distance;
+        if (lchild != NO_CHILD)
+            node->leftChild = lchild;
+        if (rchild != NO_CHILD)
+            node->rightChild = rchild;
     }
 
     inline void finaliseFile() {
         if (start_to_write) {
             if (!file) {
+                auto header = file_header();
+                fseek(myfile, 0, SEEK_SET);
+                fwrite(&header, sizeof(disk_vp_file_header), 1, myfile);
                 fclose(myfile);
                 openSortedFile(false);
             }
         }
     }
 
+    /**
+     * Vector stored at the given position: with the versioned format, it is DISKVP_ALIGNMENT-aligned
+     */
     inline float* getPTR(size_t idx) const {
         float* pt = nullptr;
         if (start_to_write) {
-            pt = (float*)((file + sizeof(unsigned int) + (sizeof(disk_vp_node_header) + (sizeof(float)*d))*idx+sizeof(disk_vp_node_header)));
+            pt = (float*)(vectors ? vectors + vectorStride*idx : record(idx) + vectorOffset);
         }
         return pt;
     }
 
+    /**
+     * Hints that the node at the given position is about to be visited: its header and the representation of its
+     * vector the searches read (fp32, quantized code or PQ code) are prefetched into the cache and, with
+     * willNeedNodes, the kernel is asked to start reading their pages without waiting for them
+     */
+    inline void prefetch(size_t pos) const {
+        const char* head = (const char*)node(pos);
+        const char* vector;
+        size_t len;
+        // Same precedence as TopKSearch::evaluate: PQ codes first, then the quantized vectors
+        if (pq) {
+            vector = (const char*)pq->codes.data() + pq->subspaces*pos;
+            len = pq->subspaces;
+        } else if (quantized) {
+            vector = quantized->codes + quantized->codeSize*pos;
+            len = quantized->codeSize;
+        } else {
+            vector = (const char*)getPTR(pos);
+            len = sizeof(float)*d;
+        }
+        if (willNeedNodes) {
+            // The in-memory topology and PQ codes never fault, and an interleaved record is advised at once
+            bool interleaved = (!topology) && (vector == head + vectorOffset);
+            if (!topology)
+                mmapAdvise(head, interleaved ? vectorOffset+len : sizeof(disk_vp_node_header), MMAP_WILLNEED);
+            if ((!interleaved) && (!pq))
+                mmapAdvise(vector, len, MMAP_WILLNEED);
+        }
+        if (prefetchNodes) {
+            __builtin_prefetch(head);
+            for (size_t i = 0; vector && (i<len); i += DISKVP_ALIGNMENT)
+                __builtin_prefetch(vector + i);
+        }
+    }
+
+    /**
+     * Prefetches both children of an inner node before its distance is computed, so that their loads overlap
+     * with it rather than being issued only once the search pops them
+     */
+    inline void prefetch_children(const disk_vp_node_header* root) const {
+        if ((!prefetchNodes) && (!willNeedNodes))
+            return;
+        if (root->leftChild != NO_CHILD)
+            prefetch(root->leftChild);
+        if (root->rightChild != NO_CHILD)
+            prefetch(root->rightChild);
+    }
+
     inline float* getSPTR(size_t idx) const {
         idx = index[idx];
-        std::vector<float> r;
         float* pt = nullptr;
         if (start_to_write) {
 //            finaliseFile();
-            pt = (float*)((file + sizeof(unsigned int) + (sizeof(disk_vp_node_header) + (sizeof(float)*d))*idx+sizeof(disk_vp_node_header)));
+            pt = (float*)(vectors ? vectors + vectorStride*idx : record(idx) + vectorOffset);
         }
         return pt;
     }
@@ -338,68 +819,88 @@ struct DiskVP {
             return dist < other.dist;
         }
 
-        unsigned int item;
+        size_t item;
         float dist;
     };
 
 
-    struct TopKSearch {
+    /**
+     * Top-k search over a VP-tree in the sorted-file layout, either a DiskVP or a DiskVPReader. Tree shall provide
+     * size(), node(pos), isDeleted(id), bucket_last(pos, head, last), distance_to(pos, query) and
+     * prefetch_children(head), as well as position(id) and getPTR(pos) for searching around an element. If it
+     * also has quantized and pq (DiskVP), the search runs over whichever of them is open.
+     */
+    template <typename Tree>
+    struct BasicTopKSearch {
         float* ptr;
-        const DiskVP* vp;
+        const Tree* vp;
         std::priority_queue<HeapItem> heap_;
         size_t k;
+        size_t nodesVisited;    ///<@ number of nodes visited by the last run, i.e. of distance computations
+        size_t rerankCandidates{0}; ///<@ with quantized vectors or PQ: candidates re-ranked over the fp32 vectors (0 for none)
+        std::vector<float> adc;     ///<@ with PQ: distances of the query subspaces from the centroids
+        bool bestFirst{false};      ///<@ whether the subtrees are visited by increasing lower bound, rather than depth-first:
+                                    ///<@ fewer distances when the tree prunes well, but no longer in file order
+        float epsilon{0};           ///<@ pruning slack: subtrees farther than tau/(1+epsilon) are skipped, so that each
+                                    ///<@ returned distance is at most (1+epsilon) times the exact one
+        size_t maxDistances{0};     ///<@ budget of distance computations per run (0 for none)
+        std::chrono::steady_clock::duration timeLimit{0};   ///<@ wall-clock budget per run (0 for none)
+        bool partial{false};        ///<@ whether the last run ran out of budget, and returned the best results found so far
+        float tauBound{std::numeric_limits<float>::max()}; ///<@ upper bound of the k-th distance known in advance, e.g. from
+                                                            ///<@ the distances of k elements: farther elements are never collected
 
-        TopKSearch(const DiskVP* vp, size_t id, size_t k);
-        TopKSearch(const DiskVP* vp, float* id, size_t k);
-
-        inline std::vector<HeapItem> run() {
-            float tau = std::numeric_limits<float>::max();
-            std::stack<size_t> s;
-            s.emplace(0);
-            while (!s.empty()) {
-                auto root_id = s.top();
-                s.pop();
-                auto root = vp->getEntryPoint(root_id);
-                double rootRadius = root->radius;
-                float dist = vp->ker(vp->d, (float*) vp->getPTR(root_id), ptr);
+        /**
+         * Search around the element with the given id (insertion order), which shall not be deleted
+         */
+        BasicTopKSearch(const Tree* vp, size_t id, size_t k) : ptr{(float*)vp->getPTR(vp->position(id))}, vp{vp}, k{k}, nodesVisited{0} {
+        }
 
-                if (definitelyLessThan(dist,tau)) {
-                    heap_.push(HeapItem{root->id, dist});
-                    if (heap_.size() > k)
-                        heap_.pop();
+        BasicTopKSearch(const Tree* vp, float* id, size_t k) : ptr{id}, vp{vp}, k{k}, nodesVisited{0} {
+        }
 
+        inline void offer(size_t id, float dist, float& tau) {
+            if (definitelyLessThan(dist,tau)) {
+                heap_.push(HeapItem{id, dist});
+                if (heap_.size() > k)
+                    heap_.pop();
 
-                    if (heap_.size() == k)
-                        tau = heap_.top().dist;
-                } else
-                    // Otherwise, if they are very similar, then I could add this other one too
-                        if (approximatelyEqual(dist, tau)) {
-                            heap_.push(HeapItem{root->id, dist});
-                            if (heap_.size() > k)
-                                heap_.pop();
 
-                            if (heap_.size() == k)
-                                tau = heap_.top().dist;
-                            tau = std::min(heap_.top().dist, tau);
-                        }
+                if (heap_.size() == k)
+                    tau = heap_.top().dist;
+            } else
+                // Otherwise, if they are very similar, then I could add this other one too
+                    if (approximatelyEqual(dist, tau)) {
+                        heap_.push(HeapItem{id, dist});
+                        if (heap_.size() > k)
+                            heap_.pop();
 
-                if (dist < rootRadius) {
-                    if (root->leftChild != std::numeric_limits<unsigned int>::max() && dist - tau <= rootRadius) {
-                        s.push(root->leftChild);
-                    }
-                    // At this stage, the tau value might be updated from the previous recursive call
-                    if (root->rightChild != std::numeric_limits<unsigned int>::max() && dist + tau >= rootRadius) {
-                        s.push(root->rightChild);
-                    }
-                } else {
-                    if (root->rightChild != std::numeric_limits<unsigned int>::max() && dist + tau >= rootRadius) {
-                        s.push(root->rightChild);
-                    }
-                    // At this stage, the tau value might be updated from the previous recursive call
-                    if (root->leftChild != std::numeric_limits<unsigned int>::max() && dist - tau <= rootRadius) {
-                        s.push(root->leftChild);
+                        if (heap_.size() == k)
+                            tau = heap_.top().dist;
+                        tau = std::min(heap_.top().dist, tau);
                     }
-                }
+        }
+
+        inline std::vector<HeapItem> run() {
+            // With re-ranking, the traversal collects more candidates than the ones returned
+            const size_t returned = k;
+            bool rerank = false;
+            if constexpr (compressed()) {
+                rerank = (vp->quantized || vp->pq) && (rerankCandidates > 0);
+                if (vp->pq)
+                    vp->pq->adc_table(ptr, adc);
+            }
+            if (rerank)
+                k = std::max(k, rerankCandidates);
+            float tau = tauBound;
+            nodesVisited = 0;
+            partial = false;
+            if (timeLimit.count() > 0)
+                deadline = std::chrono::steady_clock::now() + timeLimit;
+            if ((vp->size() > 0) && (k > 0)) {
+                if (bestFirst)
+                    best_first(tau);
+                else
+                    depth_first(tau);
             }
 
             std::vector<HeapItem> result;
@@ -407,52 +908,321 @@ struct DiskVP {
                 result.emplace_back(heap_.top());
                 heap_.pop();
             }
+            if constexpr (compressed()) {
+                if (rerank) {
+                    k = returned;
+                    for (auto& item : result)
+                        item.dist = vp->ker(vp->d, vp->getPTR(vp->idxFile[item.item]), ptr);
+                    std::sort(result.begin(), result.end());
+                    if (result.size() > k)
+                        result.resize(k);
+                    return result;
+                }
+            }
             std::reverse(result.begin(), result.end());
             return result;
         }
+
+    private:
+        std::chrono::steady_clock::time_point deadline;
+
+        /**
+         * Whether the tree may also hold compressed vectors
+         */
+        static constexpr bool compressed() {
+            return requires(const Tree* tree) { tree->quantized; tree->pq; };
+        }
+
+        inline float evaluate(size_t pos) const {
+            if constexpr (compressed()) {
+                if (vp->pq)
+                    return vp->pq->distance(pos, adc.data());
+            }
+            return vp->distance_to(pos, ptr);
+        }
+
+        /**
+         * Radius within which the subtrees are still visited
+         */
+        inline float reach(float tau) const {
+            return (epsilon > 0) ? tau / (1 + epsilon) : tau;
+        }
+
+        /**
+         * Whether the search shall stop before computing the next distance. The clock is only read once
+         * every 32 distances, as reading it costs as much as a distance computation
+         */
+        inline bool exhausted() {
+            if ((maxDistances > 0) && (nodesVisited >= maxDistances))
+                partial = true;
+            else if ((timeLimit.count() > 0) && (nodesVisited % 32 == 0) && (std::chrono::steady_clock::now() >= deadline))
+                partial = true;
+            return partial;
+        }
+
+        /**
+         * Linear scan of the leaf bucket headed at pos
+         */
+        inline void scan_bucket(size_t pos, const disk_vp_node_header* head, size_t last, float& tau) {
+            for (size_t i = pos, end = vp->bucket_last(pos, head, last); i<=end; i++) {
+                auto entry = vp->node(i);
+                if (vp->isDeleted(entry->id))
+                    continue;
+                if (exhausted())
+                    return;
+                nodesVisited++;
+                offer(entry->id, evaluate(i), tau);
+            }
+        }
+
+        /**
+         * Offers the vantage point at pos, whose distance from the query is returned
+         */
+        inline float visit_node(size_t pos, const disk_vp_node_header* root, float& tau) {
+            nodesVisited++;
+            float dist = evaluate(pos);
+            // Deleted nodes are still required for routing the search, but they are never returned
+            if (!vp->isDeleted(root->id))
+                offer(root->id, dist, tau);
+            return dist;
+        }
+
+        inline void depth_first(float& tau) {
+            // Position of each subtree root, the last position of the subtree, and its lower bound
+            std::stack<std::tuple<size_t,size_t,float>> s;
+            s.emplace(0, vp->size()-1, 0);
+            while ((!s.empty()) && (!exhausted())) {
+                auto [root_id, last, bound] = s.top();
+                s.pop();
+                // tau might have shrunk since the subtree was pushed
+                if (bound > reach(tau))
+                    continue;
+                auto root = vp->node(root_id);
+                if (root->isLeaf) {
+                    scan_bucket(root_id, root, last, tau);
+                    continue;
+                }
+                float rootRadius = root->radius;
+                vp->prefetch_children(root);
+                float dist = visit_node(root_id, root, tau);
+
+                std::tuple<size_t,size_t,float> left{root->leftChild, (root->rightChild != NO_CHILD) ? root->rightChild-1 : last, std::max(0.0f, dist - rootRadius)};
+                std::tuple<size_t,size_t,float> right{root->rightChild, last, std::max(0.0f, rootRadius - dist)};
+                bool visitLeft = (root->leftChild != NO_CHILD) && (std::get<2>(left) <= reach(tau));
+                bool visitRight = (root->rightChild != NO_CHILD) && (std::get<2>(right) <= reach(tau));
+                // The subtree the query falls within is visited first, so that tau shrinks as early as possible
+                if (dist < rootRadius) {
+                    if (visitRight) s.push(right);
+                    if (visitLeft) s.push(left);
+                } else {
+                    if (visitLeft) s.push(left);
+                    if (visitRight) s.push(right);
+                }
+            }
+        }
+
+        /**
+         * Pending subtree of the best-first visit: no element within it is closer to the query than bound
+         */
+        struct PendingSubtree {
+            float bound;
+            size_t pos;
+            size_t last;
+
+            bool operator<(const PendingSubtree& other) const {
+                return bound > other.bound;
+            }
+        };
+
+        inline void best_first(float& tau) {
+            std::priority_queue<PendingSubtree> q;
+            q.push(PendingSubtree{0, 0, vp->size()-1});
+            // As the bounds are popped in increasing order, the first one exceeding tau ends the search
+            while ((!q.empty()) && (q.top().bound <= reach(tau)) && (!exhausted())) {
+                auto [bound, root_id, last] = q.top();
+                q.pop();
+                auto root = vp->node(root_id);
+                if (root->isLeaf) {
+                    scan_bucket(root_id, root, last, tau);
+                    continue;
+                }
+                float rootRadius = root->radius;
+                vp->prefetch_children(root);
+                float dist = visit_node(root_id, root, tau);
+                // The left subtree lies within the radius, and the right one outside: by the triangle
+                // inequality, the query is at least |dist - radius| away from the side it does not fall within
+                if (root->leftChild != NO_CHILD) {
+                    float leftBound = std::max(bound, dist - rootRadius);
+                    if (leftBound <= reach(tau))
+                        q.push(PendingSubtree{leftBound, root->leftChild, (root->rightChild != NO_CHILD) ? root->rightChild-1 : last});
+                }
+                if (root->rightChild != NO_CHILD) {
+                    float rightBound = std::max(bound, rootRadius - dist);
+                    if (rightBound <= reach(tau))
+                        q.push(PendingSubtree{rightBound, root->rightChild, last});
+                }
+            }
+        }
     };
 
+    using TopKSearch = BasicTopKSearch<DiskVP>;
+
+    /**
+     * Elements within maxDistance from the query, collected by a RangeCursor
+     */
     struct MaxDistanceSearch {
         double maxDistance;
         float* ptr;
         const DiskVP* vp;
-        std::set<HeapItem> heap_;
+        std::vector<HeapItem> result;
+        size_t nodesVisited;    ///<@ number of distance computations of the last run
+        bool sorted{true};      ///<@ whether the results are sorted by increasing distance, rather than in tree order
 
         MaxDistanceSearch(const DiskVP* vp, size_t id, double maxDistance = std::numeric_limits<double>::max());
         MaxDistanceSearch(const DiskVP* vp, float* id, double maxDistance = std::numeric_limits<double>::max());
 
-        inline std::set<HeapItem> run() {
-            std::stack<std::pair<size_t,double>> s;
-            s.emplace(0, maxDistance);
-            while (!s.empty()) {
-                auto top = s.top();
-                s.pop();
-                auto root = vp->getEntryPoint(top.first);
-                double rootRadius = root->radius;
-                float dist = vp->ker(vp->d, (float*) vp->getPTR(top.first), ptr);
-                if (dist <= maxDistance)
-                    heap_.emplace(HeapItem{root->id, dist});
+        std::vector<HeapItem> run();
+    };
+
+    /**
+     * Lazy range search: the elements within maxDistance from the query are returned one at a time, in
+     * tree order, as the traversal reaches them. Only the pending subtrees are kept, which are at most as many
+     * as the tree is high, so that the memory does not grow with the results, and the consumer may stop at any
+     * time. The tree shall not change while the cursor is in use. Tree is either a DiskVP or a DiskVPReader, as
+     * for BasicTopKSearch.
+     */
+    template <typename Tree>
+    struct BasicRangeCursor {
+        BasicRangeCursor(const Tree* vp, float* query, double maxDistance) :
+                nodesVisited{0}, vp{vp}, ptr{query}, maxDistance{maxDistance}, bucketNext{1}, bucketLast{0} {
+            if (vp->size() > 0)
+                pending.emplace_back(0, vp->size()-1);
+        }
 
-                if ((root->leftChild == std::numeric_limits<unsigned int>::max()) &&
-                    (root->rightChild == std::numeric_limits<unsigned int>::max())) {
+        /**
+         * Writes the next result within item, returning false once the search is over
+         */
+        bool next(HeapItem& item) {
+            while (true) {
+                while (bucketNext <= bucketLast) {
+                    size_t i = bucketNext++;
+                    auto entry = vp->node(i);
+                    if (vp->isDeleted(entry->id))
+                        continue;
+                    nodesVisited++;
+                    float dist = vp->distance_to(i, ptr);
+                    if (dist <= maxDistance) {
+                        item = HeapItem{entry->id, dist};
+                        return true;
+                    }
+                }
+                if (pending.empty())
+                    return false;
+                auto [pos, last] = pending.back();
+                pending.pop_back();
+                auto root = vp->node(pos);
+                if (root->isLeaf) {
+                    bucketNext = pos;
+                    bucketLast = vp->bucket_last(pos, root, last);
                     continue;
                 }
-                double ddd = dist-rootRadius;
-                if(definitelyLessThan(ddd,maxDistance) || approximatelyEqual(ddd, maxDistance)) {
-                    if (root->leftChild != std::numeric_limits<unsigned int>::max() )
-                        s.emplace(root->leftChild, maxDistance);
+                nodesVisited++;
+                double rootRadius = root->radius;
+                vp->prefetch_children(root);
+                float dist = vp->distance_to(pos, ptr);
+                // The ball around the query may intersect either side of the radius
+                bool hasRight = root->rightChild != NO_CHILD;
+                if (hasRight && (dist + maxDistance >= rootRadius))
+                    pending.emplace_back(root->rightChild, last);
+                if ((root->leftChild != NO_CHILD) && (dist - maxDistance <= rootRadius))
+                    pending.emplace_back(root->leftChild, hasRight ? root->rightChild-1 : last);
+                if ((dist <= maxDistance) && (!vp->isDeleted(root->id))) {
+                    item = HeapItem{root->id, dist};
+                    return true;
                 }
-                if (root->rightChild != std::numeric_limits<unsigned int>::max())
-                    s.emplace(root->rightChild, maxDistance);
             }
-            return heap_;
         }
+
+        struct iterator {
+            using value_type = HeapItem;
+            using difference_type = std::ptrdiff_t;
+
+            BasicRangeCursor* cursor;
+            HeapItem current;
+
+            inline const HeapItem& operator*() const { return current; }
+            inline const HeapItem* operator->() const { return &current; }
+            inline iterator& operator++() {
+                if (!cursor->next(current))
+                    cursor = nullptr;
+                return *this;
+            }
+            inline void operator++(int) { ++*this; }
+            inline bool operator==(std::default_sentinel_t) const { return cursor == nullptr; }
+        };
+
+        inline iterator begin() {
+            return ++iterator{this, HeapItem{0, 0}};
+        }
+        inline std::default_sentinel_t end() const {
+            return std::default_sentinel;
+        }
+
+        size_t nodesVisited;    ///<@ distance computations so far
+
+    private:
+        const Tree* vp;
+        float* ptr;
+        double maxDistance;
+        std::vector<std::pair<size_t,size_t>> pending;  ///<@ position and last position of the subtrees still to visit
+        size_t bucketNext, bucketLast;                  ///<@ leaf bucket being scanned, empty if bucketNext > bucketLast
     };
 
+    using RangeCursor = BasicRangeCursor<DiskVP>;
+
+    /**
+     * Out-of-core counterpart of restruct_index, for files larger than the available memory. At each level,
+     * the records are physically partitioned on disk around the vantage point through sequential scans
+     * only, and the resulting tree is written to b2 in the same preorder layout as restruct_index's. As soon
+     * as the records of a subtree fit within memoryBudget bytes, the subtree is restructured in memory.
+     *
+     * Vantage points are randomly chosen at the out-of-core levels, while the in-memory subtrees follow
+     * doBalancedSorting.
+     */
+    void restruct_index_external(DiskVP& b2, size_t memoryBudget);
+
+    /**
+     * Lazy range search around the element with the given id (insertion order), which shall not be deleted, or
+     * around query: see RangeCursor
+     */
+    RangeCursor lookUpNearsetTo(size_t id, double maxDistance) const;
+    RangeCursor lookUpNearsetTo(float* query, double maxDistance) const;
 
-    void lookUpNearsetTo(size_t root_id, float* id, double maxDistance);
     void recursive_restruct_tree(size_t first, size_t last);
 
+    /**
+     * Restructures the tree by running the two subtrees of each node as separate tasks over a work-stealing
+     * pool of this->threads threads. As the two subtrees span disjoint ranges of the index, no further
+     * synchronisation is required, and the outcome is the same as recursive_restruct_tree's.
+     */
+    void parallel_restruct_tree(size_t first, size_t last);
+
+private:
+    /**
+     * Selects the vantage point for the elements in [first, last], partitions the remaining ones around it
+     * and updates the node on disk.
+     * @return Whether the node has children to be restructured, being [first+1, rc-1] and [rc, last]
+     */
+    bool restruct_node(size_t first, size_t last, size_t& rc);
+
+    /**
+     * Chooses among vpCandidates random elements in [first, last] the one whose distances from vpSamples random
+     * elements have the largest variance: such a vantage point better separates the elements within and
+     * outside its radius (Yianilos, SODA 1993)
+     */
+    size_t select_max_spread_root(size_t first, size_t last, SplitMix64& rng) const;
+    void parallel_restruct_tree(WorkStealingPool& pool, size_t first, size_t last);
+
 };
 
 
@@ -0,0 +1,133 @@
+/*
+ * DiskVPReader.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_DISKVPREADER_H
+#define SIMMATCH_DISKVPREADER_H
+
+#include "DiskVP.h"
+
+/**
+ * Immutable view of a sorted DiskVP file, for serving queries from many threads at once. The sorted file, the
+ * _idx file and, if present, the _vec and _tomb files are mapped read-only, and nothing is written after
+ * the constructor returns: the searches only keep their state on the caller's stack, so that any number of
+ * threads can query the same reader without locks. The reader takes whole cache lines, so that it never
+ * shares one with data written by other threads.
+ *
+ * All the file layouts are supported: narrow files are widened in memory once, at construction time. ker
+ * shall be safe to call concurrently, as squared_distance is.
+ */
+struct alignas(DISKVP_ALIGNMENT) DiskVPReader {
+    DiskVPReader(unsigned int d, const std::filesystem::path& vptree,
+                 const std::function<float(size_t,float*,float*)>& ker, DiskVPMetric metric = METRIC_CUSTOM);
+    virtual ~DiskVPReader();
+
+    DiskVPReader(const DiskVPReader&) = delete;
+    DiskVPReader& operator=(const DiskVPReader&) = delete;
+
+    inline size_t size() const {
+        return count;
+    }
+
+    inline const disk_vp_node_header* node(size_t pos) const {
+        return (const disk_vp_node_header*)(nodes + nodeStride*pos);
+    }
+
+    inline const float* getPTR(size_t pos) const {
+        return (const float*)(vectors + vectorStride*pos);
+    }
+
+    /**
+     * Position of the element with the given id (insertion order)
+     */
+    inline size_t position(size_t id) const {
+        return idxFile[id];
+    }
+
+    /**
+     * Deletions are the ones recorded within the _tomb file, as seen through the shared mapping
+     */
+    inline bool isDeleted(size_t id) const {
+        if (id == DiskVP::STRANDED_SLOT)
+            return true;
+        return tombstones && (id < count) && (tombstones[id / 64] & (1ULL << (id % 64)));
+    }
+
+    /**
+     * Same traversals as DiskVP's, running over the reader: each thread uses its own search objects
+     */
+    using TopKSearch = DiskVP::BasicTopKSearch<DiskVPReader>;
+    using RangeCursor = DiskVP::BasicRangeCursor<DiskVPReader>;
+
+    /**
+     * Same results as DiskVP::TopKSearch, sorted by increasing distance
+     */
+    std::vector<DiskVP::HeapItem> topK(const float* query, size_t k) const;
+
+    /**
+     * Elements within maxDistance from the query, sorted by increasing distance
+     */
+    std::vector<DiskVP::HeapItem> range(const float* query, double maxDistance) const;
+
+    inline size_t bucket_last(size_t pos, const disk_vp_node_header* head, size_t subtreeLast) const {
+        return (flags & DISKVP_FLAG_VEB_LAYOUT) ? pos + head->leftChild - 1 : subtreeLast;
+    }
+
+    inline float distance_to(size_t pos, const float* query) const {
+        return ker(d, (float*)getPTR(pos), (float*)query);
+    }
+
+    /**
+     * Same as DiskVP::prefetch_children, into the cache only
+     */
+    inline void prefetch_children(const disk_vp_node_header* root) const {
+        for (size_t child : {root->leftChild, root->rightChild}) {
+            if (child == DiskVP::NO_CHILD)
+                continue;
+            __builtin_prefetch(node(child));
+            auto vector = (const char*)getPTR(child);
+            for (size_t i = 0; i<sizeof(float)*d; i += DISKVP_ALIGNMENT)
+                __builtin_prefetch(vector + i);
+        }
+    }
+
+    const unsigned int d;
+    const std::function<float(size_t,float*,float*)> ker;
+
+private:
+    const char* nodes;              ///<@ first node, either within the mapping or within narrowNodes
+    size_t nodeStride;
+    const char* vectors;            ///<@ first vector, either within the records or within the _vec file
+    size_t vectorStride;
+    size_t count;
+    uint32_t flags;
+    const size_t* idxFile;
+    const uint64_t* tombstones;
+    const void* file;
+    const void* vecFile;
+    const void* tombFile;
+    const void* idxMap;
+    unsigned long fileLen, vecLen, tombLen, idxLen;
+    mmap_file filePtr, vecPtr, tombPtr, idxPtr;
+    std::vector<disk_vp_node_header> narrowNodes;
+
+    void close();
+};
+
+#endif //SIMMATCH_DISKVPREADER_H
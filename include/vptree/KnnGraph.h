@@ -0,0 +1,119 @@
+/*
+ * KnnGraph.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_KNNGRAPH_H
+#define SIMMATCH_KNNGRAPH_H
+
+#include "DiskVP.h"
+#include <atomic>
+
+class WorkStealingPool;
+
+#define DISKVP_KNN_MAGIC        "DVPKNNG"  ///<@ 8 bytes, including the terminator
+#define DISKVP_KNN_VERSION      1
+
+/**
+ * Header of the k-nearest-neighbour graph file. It is followed by count rows of k neighbour ids (uint64_t), and
+ * then by count rows of k distances (float), both indexed by element id, so that the whole file can be mapped
+ * and each adjacency list read in place. Each row is sorted by increasing distance; missing neighbours (deleted
+ * elements, or fewer than k other elements) are padded with KnnGraph::NO_NEIGHBOUR and an infinite distance.
+ */
+struct knn_graph_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t k;
+    uint64_t count;
+};
+static_assert(sizeof(knn_graph_header) == 24, "the graph header shall have no implicit padding");
+
+/**
+ * Builds the k-nearest-neighbour graph of all the elements of a sorted DiskVP file, each element being excluded
+ * from its own neighbours.
+ *
+ * The elements are processed in tree order: each task descends a subtree, so that consecutive queries start
+ * from nearby elements and touch the same pages. Before each search, the distances from the element to its
+ * parent vantage point and to the parent's neighbours, which are always computed first, may provide an upper
+ * bound of the distance of its k-th neighbour (seedFromParent): the search then starts with that tau. As the
+ * search visits the subtree the element falls within first, and re-checks each pending subtree against the
+ * current tau, the bound rarely prunes anything further, and seeding is therefore disabled by default.
+ * The subtrees at the topmost levels are processed as separate tasks over a work-stealing pool.
+ *
+ * The graph is written to a file mapped in memory, which is also where the parents' neighbours are read from.
+ * Seeding is skipped if vp searches over quantized vectors, as their distances are not bounded by the exact ones.
+ */
+struct KnnGraphBuilder {
+    const DiskVP* vp;
+    size_t k;
+    size_t threads;
+    bool seedFromParent{false};         ///<@ whether tau is initialised by the parent's neighbours
+    size_t distanceComputations{0};     ///<@ distances computed by the last build, including the seeding ones
+
+    KnnGraphBuilder(const DiskVP* vp, size_t k, size_t threads = 1);
+
+    /**
+     * Writes the graph to the given file, replacing it
+     */
+    void build(const std::filesystem::path& graph);
+
+private:
+    struct Output;
+    void visit(WorkStealingPool& pool, Output& out, size_t pos, size_t last, size_t parent, size_t depth);
+    size_t visit_sequential(Output& out, size_t pos, size_t last, size_t parent);
+    size_t process(Output& out, size_t pos, size_t parent);
+    std::atomic<size_t> distances{0};
+};
+
+/**
+ * Read-only view of a graph written by KnnGraphBuilder
+ */
+struct KnnGraph {
+    static constexpr uint64_t NO_NEIGHBOUR = std::numeric_limits<uint64_t>::max();
+
+    explicit KnnGraph(const std::filesystem::path& graph);
+    virtual ~KnnGraph();
+
+    KnnGraph(const KnnGraph&) = delete;
+    KnnGraph& operator=(const KnnGraph&) = delete;
+
+    inline size_t size() const {
+        return header->count;
+    }
+
+    inline size_t k() const {
+        return header->k;
+    }
+
+    inline std::span<const uint64_t> neighbours(size_t id) const {
+        return {ids + id*header->k, header->k};
+    }
+
+    inline std::span<const float> distances(size_t id) const {
+        return {dists + id*header->k, header->k};
+    }
+
+private:
+    const knn_graph_header* header;
+    const uint64_t* ids;
+    const float* dists;
+    unsigned long len;
+    mmap_file ptr;
+};
+
+#endif //SIMMATCH_KNNGRAPH_H
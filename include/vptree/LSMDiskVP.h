@@ -0,0 +1,120 @@
+/*
+ * LSMDiskVP.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_LSMDISKVP_H
+#define SIMMATCH_LSMDISKVP_H
+
+#include "Builder.h"
+#include <exception>
+#include <memory>
+#include <shared_mutex>
+#include <thread>
+
+/**
+ * Log-structured VP-tree, accepting insertions without rebuilding the whole tree at each new vector.
+ *
+ * The vectors are stored across:
+ *  - the main tree generation, a DiskVP built by Builder and stored in base.<generation>;
+ *  - an append-only delta segment (base.delta), which is also kept in memory and searched by brute force;
+ *  - the delta segment being currently merged (base.delta.merging), if any, alongside the generation it is
+ *    merged into (base.delta.merging.target).
+ *
+ * Once the delta segment reaches mergeThreshold vectors, a background thread builds the next generation out of
+ * the main tree and the delta, while queries keep on being answered from the previous generation and the
+ * frozen delta. The ids are the insertion order, across all the generations.
+ *
+ * Durability: each insertion is flushed to the delta log before its id is returned, so that it survives the
+ * crash of the process, while sync() also forces it to the disk, so that it survives the crash of the system.
+ * A merge only switches to the new generation once it is on the disk, by atomically replacing base.generation;
+ * the frozen delta and the previous generation are removed afterwards. Reopening after a crash either restarts
+ * the merge, or discards the frozen delta if its target generation was already reached.
+ *
+ * As the tree is built by Builder, the metric is squared_distance.
+ */
+class LSMDiskVP {
+    unsigned int d;
+    std::filesystem::path base;
+    size_t mergeThreshold;
+    size_t generation;
+    std::unique_ptr<DiskVP> main;   ///<@ current generation, if any
+    size_t mainSize;
+    std::vector<float> delta;       ///<@ vectors inserted after the last merge started
+    std::vector<float> frozen;      ///<@ vectors being merged into the next generation
+    FILE* deltaLog;
+    bool merging;
+    std::exception_ptr mergeError;  ///<@ failure of the last background merge, not yet rethrown
+    std::thread merger;
+    std::mutex mergerMutex;
+    mutable std::shared_mutex lock;
+
+public:
+    /**
+     * Opens the LSM tree stored with the base name, if any, also replaying the delta segments
+     *
+     * @param d                 Vector dimension
+     * @param base              Base name of the files
+     * @param mergeThreshold    Size of the delta segment triggering the building of a new generation
+     */
+    LSMDiskVP(unsigned int d, const std::filesystem::path& base, size_t mergeThreshold = 100000);
+    virtual ~LSMDiskVP();
+
+    /**
+     * Appends a vector to the delta segment
+     * @return The id associated to the vector
+     */
+    size_t insert(const float* vector);
+
+    inline size_t insert(const std::vector<float>& vector) {
+        return insert(vector.data());
+    }
+
+    /**
+     * Top-k search merging the results from the main tree and the delta segments
+     */
+    std::vector<DiskVP::HeapItem> topK(float* query, size_t k) const;
+
+    /**
+     * Builds a new generation out of the current delta segment. If the last merge failed, its error is rethrown
+     * first, and the next call merges again the same frozen delta
+     * @param background    Whether the call returns immediately, while the generation is built by another thread
+     */
+    void merge(bool background = true);
+
+    /**
+     * Blocks until the background merge, if any, is completed, and rethrows its error if it failed
+     */
+    void waitForMerge();
+
+    /**
+     * Forces the delta segment to the disk
+     */
+    void sync();
+
+    size_t size() const;
+
+private:
+    std::filesystem::path generationFile(size_t gen) const;
+    void replay(const std::filesystem::path& log, std::vector<float>& segment);
+    void mergeFrozen();
+    void runMerge(bool background);
+    void rethrowMergeError();
+};
+
+#endif //SIMMATCH_LSMDISKVP_H
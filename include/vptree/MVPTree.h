@@ -0,0 +1,182 @@
+/*
+ * MVPTree.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_MVPTREE_H
+#define SIMMATCH_MVPTREE_H
+
+#include "DiskVP.h"
+
+struct mvp_file_header {
+    uint32_t d;
+    uint32_t m;
+    uint32_t leafCapacity;
+    uint32_t pathLength;
+    uint64_t root;        ///<@ offset of the root node
+};
+
+/**
+ * Header of each MVP-tree node. Internal nodes are followed by the m*m child offsets (uint64_t) and by the
+ * m-1 cut radii of the first vantage point and the m*(m-1) ones of the second; leaves are followed by count
+ * mvp_leaf_entry, each immediately followed by its pathCount path distances.
+ */
+struct mvp_node_header {
+    uint32_t isLeaf;
+    uint32_t count;       ///<@ number of entries within a leaf, besides the vantage points
+    uint32_t vp1;         ///<@ id of the first vantage point
+    uint32_t vp2;         ///<@ id of the second vantage point, or MVPTree::NONE
+    uint32_t pathCount;   ///<@ number of path distances stored within each leaf entry
+    uint32_t padding;
+};
+
+struct mvp_leaf_entry {
+    uint32_t id;
+    float d1;             ///<@ distance from the first vantage point of the leaf
+    float d2;             ///<@ distance from the second vantage point of the leaf
+};
+
+/**
+ * Multi-vantage-point tree (Bozkaya and Ozsoyoglu, SIGMOD 1997), built over the vectors already stored by a
+ * DiskVP. Each node has two vantage points: the first one splits its elements into m groups by distance, and
+ * the second one splits each group into further m groups, thus resulting into m*m children. Each leaf entry
+ * stores its distances from the first pathLength vantage points on its root path, so that most of them are
+ * discarded by the triangle inequality without calling ker.
+ *
+ * The tree is stored in its own file, referring to the vectors via their id; nodes are written in postorder,
+ * and the root is the last one. As the pruning relies on the triangle inequality, ker must be a metric.
+ */
+struct MVPTree {
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+    static constexpr uint64_t NO_CHILD = std::numeric_limits<uint64_t>::max();
+
+    const DiskVP* storage;          ///<@ sorted DiskVP providing the vectors and ker
+    std::filesystem::path mvptree;
+    unsigned int m;                 ///<@ number of groups per vantage point
+    unsigned int leafCapacity;      ///<@ maximum number of entries within a leaf
+    unsigned int pathLength;        ///<@ number of path distances stored within each leaf entry
+    uint64_t seed;
+    uint64_t root;
+    unsigned long mmapfilelen;
+    mmap_file fileptr;
+    char* file;
+
+    /**
+     * @param storage       DiskVP opened through openSortedFile, providing the vectors by id
+     * @param mvptree       File where the MVP-tree is stored
+     * @param m             Number of groups per vantage point, and therefore the fanout is m*m
+     * @param leafCapacity  Maximum number of entries within a leaf
+     * @param pathLength    Number of path distances stored within each leaf entry
+     */
+    MVPTree(const DiskVP* storage, const std::filesystem::path& mvptree, unsigned int m = 3,
+            unsigned int leafCapacity = 32, unsigned int pathLength = 8) :
+            storage{storage}, mvptree{mvptree}, m{std::max(2U, m)}, leafCapacity{std::max(1U, leafCapacity)},
+            pathLength{pathLength}, seed{std::mt19937::default_seed}, root{NO_CHILD}, file{nullptr} {
+    }
+
+    virtual ~MVPTree() {
+        closeFile();
+    }
+
+    /**
+     * Builds the tree over all the elements of storage that are not deleted, and writes it to mvptree
+     */
+    void build();
+
+    /**
+     * Memory-maps a tree previously built, whose parameters replace the ones given at construction time
+     */
+    void openFile();
+
+    inline void closeFile() {
+        if (file)
+            mmapClose(file, &fileptr);
+        file = nullptr;
+    }
+
+    inline float* getVector(uint32_t id) const {
+        return storage->getPTR(storage->idxFile[id]);
+    }
+
+    inline const mvp_node_header* getNode(uint64_t offset) const {
+        return (const mvp_node_header*)(file + offset);
+    }
+
+    inline const uint64_t* getChildren(const mvp_node_header* node) const {
+        return (const uint64_t*)(node + 1);
+    }
+
+    /**
+     * Cut radii of the first vantage point, followed by the ones of the second vantage point for each group
+     */
+    inline const float* getCuts(const mvp_node_header* node) const {
+        return (const float*)(getChildren(node) + m*m);
+    }
+
+    inline const mvp_leaf_entry* getEntry(const mvp_node_header* node, size_t i) const {
+        return (const mvp_leaf_entry*)((const char*)(node + 1) + i*entry_size(node->pathCount));
+    }
+
+    static inline size_t entry_size(size_t pathCount) {
+        return sizeof(mvp_leaf_entry) + pathCount*sizeof(float);
+    }
+
+    struct TopKSearch {
+        float* ptr;
+        const MVPTree* tree;
+        std::priority_queue<DiskVP::HeapItem> heap_;
+        size_t k;
+        float tau;
+        std::vector<float> queryPath;   ///<@ distances of the query from the vantage points on the current path
+        size_t distanceComputations;    ///<@ number of calls to ker during the last run
+
+        TopKSearch(const MVPTree* tree, float* ptr, size_t k);
+        std::vector<DiskVP::HeapItem> run();
+
+    private:
+        void offer(uint32_t id, float dist);
+        void visit(uint64_t offset, size_t depthPath);
+    };
+
+    struct MaxDistanceSearch {
+        double maxDistance;
+        float* ptr;
+        const MVPTree* tree;
+        std::vector<float> queryPath;
+        std::vector<DiskVP::HeapItem> result;
+        size_t distanceComputations;
+
+        MaxDistanceSearch(const MVPTree* tree, float* ptr, double maxDistance);
+        std::vector<DiskVP::HeapItem> run();
+
+    private:
+        void visit(uint64_t offset, size_t depthPath);
+    };
+
+private:
+    struct BuildContext;
+    /**
+     * Builds the subtree over the elements in [begin, end) of the build order, whose ancestors provided
+     * depthPath path distances, and appends it to the file
+     * @return The offset of the subtree root
+     */
+    uint64_t build(BuildContext& ctx, size_t begin, size_t end, size_t depthPath);
+    float distance(uint32_t l, uint32_t r) const;
+};
+
+#endif //SIMMATCH_MVPTREE_H
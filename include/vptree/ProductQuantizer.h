@@ -0,0 +1,109 @@
+/*
+ * ProductQuantizer.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_PRODUCTQUANTIZER_H
+#define SIMMATCH_PRODUCTQUANTIZER_H
+
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+struct DiskVP;
+
+#define DISKVP_PQ_MAGIC     "DISKVPP"   ///<@ 8 bytes, including the terminator
+#define DISKVP_PQ_CENTROIDS (256)       ///<@ centroids per subspace, so that each code is a byte
+
+/**
+ * Header of the _pq file, followed by the DISKVP_PQ_CENTROIDS centroids of each subspace (the ones of the
+ * first subspace, then the ones of the second, and so on), and by the codes: subspaces bytes per position of
+ * the sorted file, with no padding.
+ */
+struct pq_file_header {
+    char magic[8];          ///<@ DISKVP_PQ_MAGIC
+    uint32_t d;
+    uint32_t subspaces;
+    uint64_t count;         ///<@ number of codes
+    uint64_t codesOffset;   ///<@ offset of the first code within the file
+    char padding[32];
+};
+
+static_assert(sizeof(pq_file_header) == 64, "the file header takes a whole cache line");
+
+/**
+ * Product quantization (Jégou et al., TPAMI 2011): the dimensions are split into subspaces, each one having
+ * its own codebook of DISKVP_PQ_CENTROIDS centroids trained by k-means, and each vector is stored as the
+ * index of the nearest centroid within each subspace. The Euclidean distance from a query is then
+ * approximated by summing, for each subspace, the distance between the query and the chosen centroid:
+ * such distances are tabulated once per query (asymmetric distance computation), so that each candidate
+ * only costs subspaces table lookups.
+ *
+ * Differently from the memory-mapped QuantizedVectors, the codes are loaded in memory, as they are meant
+ * to keep billion-scale indices resident.
+ */
+struct ProductQuantizer {
+    unsigned int d;
+    unsigned int subspaces;
+    size_t count;
+    std::vector<size_t> begin;      ///<@ first dimension of each subspace, followed by d
+    std::vector<float> centroids;   ///<@ codebooks: the ones of subspace m start at DISKVP_PQ_CENTROIDS*begin[m]
+    std::vector<uint8_t> codes;
+
+    ProductQuantizer() : d{0}, subspaces{0}, count{0} {}
+
+    /**
+     * Trains the codebooks over trainingSamples random vectors of vp, and encodes all of its positions
+     *
+     * @param subspaces         Number of subspaces, i.e. bytes per vector: at most vp.d
+     * @param trainingSamples   Number of vectors over which k-means runs
+     * @param iterations        Number of k-means iterations
+     */
+    void train(const DiskVP& vp, unsigned int subspaces, size_t trainingSamples = 65536, size_t iterations = 25);
+
+    /**
+     * Encodes the vectors of vp, in position order, with the current codebooks
+     */
+    void encode(const DiskVP& vp);
+
+    void write(const std::filesystem::path& out) const;
+    void read(const std::filesystem::path& in);
+
+    /**
+     * Fills table with the squared distances of each subspace of the query from each centroid
+     */
+    void adc_table(const float* query, std::vector<float>& table) const;
+
+    /**
+     * Approximated Euclidean distance between the query whose table is given and the code at pos
+     */
+    inline float distance(size_t pos, const float* table) const {
+        const uint8_t* code = codes.data() + subspaces*pos;
+        float s = 0;
+        for (size_t m = 0; m<subspaces; m++, table += DISKVP_PQ_CENTROIDS)
+            s += table[code[m]];
+        return std::sqrt(s);
+    }
+
+private:
+    void set_subspaces(unsigned int d, unsigned int subspaces);
+    uint8_t nearest(size_t m, const float* v) const;
+};
+
+#endif //SIMMATCH_PRODUCTQUANTIZER_H
@@ -0,0 +1,108 @@
+/*
+ * QuantizedVectors.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_QUANTIZEDVECTORS_H
+#define SIMMATCH_QUANTIZEDVECTORS_H
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+#include "mmapFile.h"
+
+struct DiskVP;
+
+enum VectorCodec : uint32_t {
+    CODEC_FP32 = 0,     ///<@ no quantization
+    CODEC_FP16 = 1,     ///<@ IEEE half precision
+    CODEC_BF16 = 2,     ///<@ bfloat16: the upper half of the fp32 representation
+    CODEC_INT8 = 3      ///<@ one byte per dimension, linearly mapping each dimension's [min, max]
+};
+
+#define DISKVP_QUANTIZED_MAGIC  "DISKVPQ"   ///<@ 8 bytes, including the terminator
+#define DISKVP_CODE_ALIGNMENT   (32)        ///<@ each code starts at an AVX boundary
+
+/**
+ * Header of the _q file. For CODEC_INT8, it is followed by the d per-dimension minima and the d scales, and
+ * then by the codes, one per position of the sorted file, each padded to DISKVP_CODE_ALIGNMENT bytes.
+ */
+struct quantized_file_header {
+    char magic[8];          ///<@ DISKVP_QUANTIZED_MAGIC
+    uint32_t codec;         ///<@ VectorCodec
+    uint32_t d;
+    uint64_t count;         ///<@ number of codes
+    uint64_t codeSize;      ///<@ size of each (padded) code, in bytes
+    uint64_t codesOffset;   ///<@ offset of the first code within the file
+    char padding[24];
+};
+
+static_assert(sizeof(quantized_file_header) == 64, "the file header takes a whole cache line");
+
+/**
+ * Compressed copy of the vectors of a sorted DiskVP, stored in position order within the _q file alongside
+ * it. The Euclidean distance from an fp32 query is computed directly over the codes, by kernels fusing the
+ * decoding with the distance: AVX2/F16C ones are chosen at run time when the CPU supports them.
+ */
+struct QuantizedVectors {
+    unsigned int d;
+    VectorCodec codec;
+    size_t count;
+    size_t codeSize;
+    std::vector<float> minP;    ///<@ CODEC_INT8: minimum of each dimension
+    std::vector<float> scale;   ///<@ CODEC_INT8: (max-min)/255 for each dimension
+    unsigned long len;
+    mmap_file ptr;
+    char* file;
+    const char* codes;
+    float (*kernel)(const QuantizedVectors&, const char*, const float*);
+
+    QuantizedVectors() : d{0}, codec{CODEC_FP32}, count{0}, codeSize{0}, len{0}, file{nullptr}, codes{nullptr},
+                         kernel{nullptr} {}
+
+    virtual ~QuantizedVectors() {
+        close();
+    }
+
+    QuantizedVectors(const QuantizedVectors&) = delete;
+    QuantizedVectors& operator=(const QuantizedVectors&) = delete;
+
+    /**
+     * Quantizes the vectors of the sorted file vp in position order, calibrating the int8 ranges on them
+     */
+    static void build(const DiskVP& vp, const std::filesystem::path& out, VectorCodec codec);
+
+    void open(const std::filesystem::path& in);
+    void close();
+
+    /**
+     * Bytes per dimension of each codec
+     */
+    static size_t bytes_per_dimension(VectorCodec codec);
+
+    /**
+     * Euclidean distance between the fp32 query and the code at the given position
+     */
+    inline float distance(size_t pos, const float* query) const {
+        return kernel(*this, codes + codeSize*pos, query);
+    }
+
+    void decode(size_t pos, float* out) const;
+};
+
+#endif //SIMMATCH_QUANTIZEDVECTORS_H
@@ -0,0 +1,113 @@
+/*
+ * SimilarityJoin.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_SIMILARITYJOIN_H
+#define SIMMATCH_SIMILARITYJOIN_H
+
+#include "DiskVP.h"
+#include <stxxl/vector>
+#include <atomic>
+
+/**
+ * Pair of elements within the join distance, identified by their ids (insertion order)
+ */
+struct JoinPair {
+    uint64_t left;      ///<@ element of the first tree (for self-joins, the smaller id)
+    uint64_t right;     ///<@ element of the second tree
+    float dist;
+};
+
+/**
+ * Destination of the join results. The pairs are handed over in chunks, one call at a time, so that the sinks
+ * do not need to be thread-safe
+ */
+struct JoinSink {
+    virtual ~JoinSink() = default;
+    virtual void append(std::span<const JoinPair> pairs) = 0;
+};
+
+/**
+ * Disk-backed sink: the pairs are appended to an external-memory vector, whose cache only keeps a few blocks
+ */
+struct StxxlJoinSink : JoinSink {
+    stxxl::VECTOR_GENERATOR<JoinPair>::result pairs;
+
+    void append(std::span<const JoinPair> pairs) override;
+};
+
+/**
+ * All the pairs within maxDistance, either between the elements of two sorted DiskVP trees (R⋈S) or within a
+ * single one (self-join, where each unordered pair of distinct elements is returned once).
+ *
+ * The elements of r are taken in blocks of consecutive positions, i.e. of nearby elements, as each subtree is
+ * stored contiguously. Each block traverses s together, as a node pair: a node of s is visited once for all
+ * the elements of the block whose ball of radius maxDistance still reaches it. A child is pruned per
+ * element, by the same inner/outer shell test as the range search, and the whole pair is dropped as soon as
+ * no element is left. The vectors of s are compared with all the active elements of the block at once. Within
+ * a self-join, the pairs are only generated from the element with the smaller position, so that each
+ * subtree lying entirely before an element is skipped for it (preorder layouts only).
+ *
+ * The blocks run as separate tasks over a work-stealing pool. Each task buffers its results, and flushes them
+ * to the sink every bufferSize pairs. The join always runs over the fp32 vectors, skipping the deleted elements.
+ */
+struct SimilarityJoin {
+    static constexpr size_t MAX_BLOCK = 64;    ///<@ the elements of a block are tracked by a 64-bit mask
+
+    const DiskVP* r;
+    const DiskVP* s;                    ///<@ same as r for self-joins
+    double maxDistance;
+    size_t threads;
+    size_t blockSize{MAX_BLOCK};        ///<@ elements of r traversing s together, at most MAX_BLOCK
+    size_t bufferSize{1 << 14};         ///<@ pairs buffered by each task before being handed to the sink
+    size_t distanceComputations{0};     ///<@ distances computed by the last run
+    size_t pairsFound{0};               ///<@ pairs written by the last run
+
+    /**
+     * R⋈S join: the trees shall share the dimension and the distance function
+     */
+    SimilarityJoin(const DiskVP* r, const DiskVP* s, double maxDistance, size_t threads = 1);
+
+    /**
+     * Self-join
+     */
+    SimilarityJoin(const DiskVP* r, double maxDistance, size_t threads = 1);
+
+    /**
+     * Writes all the pairs to the sink, in no particular order
+     * @return The number of pairs
+     */
+    size_t run(JoinSink& sink);
+
+    inline bool is_self_join() const {
+        return r == s;
+    }
+
+private:
+    struct Block;
+    struct Context;
+    JoinSink* sink{nullptr};
+    std::mutex sinkMutex;
+    std::atomic<size_t> distances{0};
+    std::atomic<size_t> found{0};
+
+    void join_block(size_t first, size_t count, Context& ctx);
+};
+
+#endif //SIMMATCH_SIMILARITYJOIN_H
@@ -0,0 +1,103 @@
+/*
+ * VectorBlock.h
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMMATCH_VECTORBLOCK_H
+#define SIMMATCH_VECTORBLOCK_H
+
+#include "DiskVP.h"
+#include <cmath>
+
+/**
+ * Internal to BatchTopKSearch and SimilarityJoin: up to MAX_BLOCK vectors traversing a tree together, which
+ * are compared with each visited vector at once. The vectors of the block are also stored transposed, so
+ * that the one-vs-many kernel reads them with unit stride.
+ */
+struct VectorBlock {
+    static constexpr size_t MAX_BLOCK = 64;     ///<@ the vectors of a block are tracked by a 64-bit mask
+
+    size_t count;
+    size_t d;
+    const float* rows[MAX_BLOCK];       ///<@ each vector, as given
+    std::vector<float> transposed;      ///<@ d rows of count values: the j-th dimension of all the vectors
+    float dist[MAX_BLOCK];              ///<@ distances computed by the last call to distances
+
+    explicit VectorBlock(size_t d) : count{0}, d{d} {}
+
+    /**
+     * Appends a vector, which shall outlive the block
+     */
+    inline void add(const float* row) {
+        rows[count++] = row;
+    }
+
+    /**
+     * Fills transposed, once all the vectors are added
+     */
+    inline void transpose() {
+        transposed.resize(d*count);
+        for (size_t q = 0; q<count; q++)
+            for (size_t j = 0; j<d; j++)
+                transposed[j*count+q] = rows[q][j];
+    }
+
+    /**
+     * Mask of all the vectors of the block
+     */
+    inline uint64_t all() const {
+        return (count == MAX_BLOCK) ? ~0ULL : ((1ULL << count) - 1);
+    }
+
+    /**
+     * One-vs-many Euclidean kernel: the vector is read once, while the innermost loop runs across the block,
+     * and is therefore vectorised over it. Each distance is accumulated in the same order as
+     * squared_distance's, thus providing the very same value.
+     */
+    inline void euclidean(const float* v) {
+        for (size_t q = 0; q<count; q++)
+            dist[q] = 0;
+        const float* column = transposed.data();
+        for (size_t j = 0; j<d; j++, column += count) {
+            const float x = v[j];
+            for (size_t q = 0; q<count; q++) {
+                float f = x - column[q];
+                dist[q] += f*f;
+            }
+        }
+        for (size_t q = 0; q<count; q++)
+            dist[q] = std::sqrt(dist[q]);
+    }
+
+    /**
+     * Distances between the vector and the ones of the block within mask
+     */
+    inline void distances(const DiskVP* vp, const float* v, uint64_t mask) {
+        // The kernel computes all of the distances: it is only worth it when most of the vectors are active
+        if ((vp->metric == METRIC_EUCLIDEAN) && (4*(size_t)__builtin_popcountll(mask) >= count)) {
+            euclidean(v);
+            return;
+        }
+        for (uint64_t m = mask; m; m &= m-1) {
+            size_t q = __builtin_ctzll(m);
+            dist[q] = vp->ker(d, (float*)v, (float*)rows[q]);
+        }
+    }
+};
+
+#endif //SIMMATCH_VECTORBLOCK_H
@@ -26,12 +26,77 @@
 #ifndef SIMMATCH_DISK_VP_NODE_HEADER_H
 #define SIMMATCH_DISK_VP_NODE_HEADER_H
 
+#include <cstdint>
+
+/**
+ * Node of the tree: ids and child positions are 64 bits wide, so that a single file can store more than 2^32
+ * vectors. The null child is DiskVP::NO_CHILD.
+ */
 struct disk_vp_node_header {
-    unsigned int id; ///<@ id associated to the current node (i.e., insertion order)
-    float radius;   ///<@ radius that, in the standard definition, provides the boundary between the left and right nodes
-    unsigned int leftChild; // = std::numeric_limits<unsigned int>::max(); ///<@ setting the leftChild to nullptr
-    unsigned int rightChild; // = std::numeric_limits<unsigned int>::max(); ///<@ setting the rightChild to nullptr
-    bool isLeaf; // = false; ///<@ nevertheless, each node is not necessairly a leaf
+    uint64_t id;            ///<@ id associated to the current node (i.e., insertion order)
+    float radius;           ///<@ radius that, in the standard definition, provides the boundary between the left and right nodes
+    bool isLeaf;            ///<@ whether the node heads a leaf bucket, whose whole subtree is linearly scanned rather than visited
+    uint64_t leftChild;     ///<@ position of the left child
+    uint64_t rightChild;    ///<@ position of the right child
+};
+
+static_assert(sizeof(disk_vp_node_header) == 32, "the node header is not expected to have further padding");
+
+/**
+ * Node of the files written before the 64-bit ids (DISKVP_NARROW_VERSION and DISKVP_LEGACY_VERSION), whose
+ * null child is std::numeric_limits<uint32_t>::max(). Such files are widened in memory once opened.
+ */
+struct disk_vp_narrow_node_header {
+    uint32_t id;
+    float radius;
+    uint32_t leftChild;
+    uint32_t rightChild;
+    bool isLeaf;
+};
+
+#define DISKVP_MAGIC            "DISKVPF"   ///<@ 8 bytes, including the terminator
+#define DISKVP_LEGACY_VERSION   (1)         ///<@ unversioned layout: the dimension, followed by unpadded records
+#define DISKVP_NARROW_VERSION   (2)         ///<@ versioned layout with 32-bit ids and child positions
+#define DISKVP_FORMAT_VERSION   (3)
+#define DISKVP_ALIGNMENT        (64)        ///<@ cache line, and the widest SIMD load
+
+/**
+ * disk_vp_file_header::flags: the records are in van Emde Boas order rather than in preorder. Leaf buckets are
+ * still contiguous, and their head stores the number of elements of the bucket within leftChild.
+ */
+#define DISKVP_FLAG_VEB_LAYOUT  (1U << 0)
+
+/**
+ * disk_vp_file_header::flags: the file only stores the topology, as a dense array of disk_vp_node_header,
+ * while the vectors are stored within the _vec file, after a header of its own, in DISKVP_ALIGNMENT-aligned
+ * slots. Both are indexed by the same positions.
+ */
+#define DISKVP_FLAG_SPLIT       (1U << 1)
+
+/**
+ * Metric the tree was built with, so that a file is not queried with a different one by mistake
+ */
+enum DiskVPMetric : uint32_t {
+    METRIC_CUSTOM = 0,          ///<@ not recorded: no check is performed
+    METRIC_EUCLIDEAN = 1
 };
 
+/**
+ * Header of the versioned file format, taking a whole cache line. It is followed by the records, each being
+ * the node header padded to DISKVP_ALIGNMENT bytes, followed by the vector padded to DISKVP_ALIGNMENT bytes:
+ * as the file is memory-mapped at a page boundary, each vector is then aligned for SIMD loads.
+ */
+struct disk_vp_file_header {
+    char magic[8];          ///<@ DISKVP_MAGIC
+    uint32_t version;       ///<@ DISKVP_FORMAT_VERSION
+    uint32_t d;             ///<@ vector dimension
+    uint64_t count;         ///<@ number of records
+    uint32_t metric;        ///<@ DiskVPMetric
+    uint32_t flags;         ///<@ DISKVP_FLAG_* bits
+    uint64_t recordSize;    ///<@ size of each record, in bytes
+    char padding[24];
+};
+
+static_assert(sizeof(disk_vp_file_header) == DISKVP_ALIGNMENT, "the file header takes a whole cache line");
+
 #endif //SIMMATCH_DISK_VP_NODE_HEADER_H
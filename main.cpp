@@ -59,6 +59,797 @@ void vp_tree_example() {
     unlink("dataset/vp.bin_idx");
 }
 
+#include <chrono>
+#include <fstream>
+#include <iterator>
+
+/**
+ * Writes n random vectors of dimension d within the builder, always generating the same dataset
+ */
+static void fill_random_dataset(Builder& b, size_t n, size_t d, uint64_t seed = 0) {
+    std::mt19937_64 gen{seed};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> row(d);
+    for (size_t i = 0; i<n; i++) {
+        for (auto& x : row)
+            x = uni(gen);
+        b.write_entry_to_disk(row);
+    }
+}
+
+void vp_tree_parallel_build_benchmark(size_t n = 1000000, size_t d = 64) {
+    std::string reference;
+    for (size_t threads : {1, 8, 64}) {
+        std::string fn = "dataset/vp_bench_"+std::to_string(threads)+".bin";
+        Builder b(d, fn, -1, RANDOM_ROOT_UNBALANCED, threads);
+        fill_random_dataset(b, n, d);
+        auto start = std::chrono::steady_clock::now();
+        b.build();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "threads=" << threads << " build=" << elapsed.count() << "s throughput="
+                  << ((double)n)/elapsed.count() << " vectors/s" << std::endl;
+        if (reference.empty()) {
+            reference = fn;
+        } else {
+            std::ifstream l(reference, std::ios::binary), r(fn, std::ios::binary);
+            bool same = std::equal(std::istreambuf_iterator<char>(l), std::istreambuf_iterator<char>(),
+                                   std::istreambuf_iterator<char>(r), std::istreambuf_iterator<char>());
+            std::cout << " - same file as the sequential build: " << (same ? "yes" : "NO") << std::endl;
+            unlink(fn.c_str());
+            unlink((fn+"_idx").c_str());
+        }
+    }
+    unlink(reference.c_str());
+    unlink((reference+"_idx").c_str());
+}
+
+/**
+ * Average number of nodes visited by a top-k query, for each vantage point selection strategy
+ */
+void vp_tree_strategy_benchmark(size_t n = 200000, size_t d = 32, size_t k = 10, size_t queries = 1000) {
+    std::vector<std::pair<std::string, VPTRee_Strategies>> strategies{
+            {"random", RANDOM_ROOT_UNBALANCED},
+            {"geometric median", BALANCED_ROOT_IS_GEOMETRIC_MEDIAN},
+            {"halfway blockade", BALANCED_ROOT_IS_HALFWAY_BLOCKADE},
+            {"max spread", SAMPLED_ROOT_MAX_SPREAD}};
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(d);
+    for (const auto& [name, strategy] : strategies) {
+        std::string fn = "dataset/vp_strategy.bin";
+        {
+            int blockade = (strategy == BALANCED_ROOT_IS_HALFWAY_BLOCKADE) ? 64 : -1;
+            Builder b(d, fn, blockade, strategy);
+            fill_random_dataset(b, n, d);
+            b.build();
+        }
+        DiskVP vp(d, fn, squared_distance);
+        vp.openSortedFile();
+        gen.seed(1);
+        size_t visited = 0;
+        for (size_t q = 0; q<queries; q++) {
+            for (auto& x : query)
+                x = uni(gen);
+            DiskVP::TopKSearch search(&vp, query.data(), k);
+            search.run();
+            visited += search.nodesVisited;
+        }
+        std::cout << name << ": " << ((double)visited)/queries << " nodes visited per query" << std::endl;
+        vp.closeSortedFile();
+        unlink(fn.c_str());
+        unlink((fn+"_idx").c_str());
+    }
+}
+
+void vp_tree_leaf_bucket_benchmark(size_t n = 1000000, size_t d = 32, size_t k = 10, size_t queries = 1000) {
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(d);
+    for (size_t bucket : {0, 16, 64, 256}) {
+        std::string fn = "dataset/vp_bucket.bin";
+        {
+            Builder b(d, fn);
+            b.setLeafBucketSize(bucket);
+            fill_random_dataset(b, n, d);
+            b.build();
+        }
+        DiskVP vp(d, fn, squared_distance);
+        vp.openSortedFile();
+        gen.seed(1);
+        size_t visited = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t q = 0; q<queries; q++) {
+            for (auto& x : query)
+                x = uni(gen);
+            DiskVP::TopKSearch search(&vp, query.data(), k);
+            search.run();
+            visited += search.nodesVisited;
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "bucket " << bucket << ": " << ((double)visited)/queries << " distances, "
+                  << elapsed.count()/queries << " ms per query" << std::endl;
+        vp.closeSortedFile();
+        unlink(fn.c_str());
+        unlink((fn+"_idx").c_str());
+    }
+}
+
+#include <sys/resource.h>
+
+static size_t page_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+/**
+ * Compares the preorder and the van Emde Boas layouts, with the records either interleaved or split into the
+ * topology and the vectors. Cold: the page cache is dropped and the file is mapped
+ * anew before each query, so that the faults count the pages touched by the query. Warm: the same queries
+ * are run again over a mapping whose pages are all resident.
+ */
+void vp_tree_layout_benchmark(size_t n = 1000000, size_t d = 32, size_t k = 10, size_t queries = 200) {
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(d);
+    std::vector<std::tuple<std::string, bool, bool>> layouts{
+            {"preorder", false, false},
+            {"van Emde Boas", true, false},
+            {"preorder, split", false, true},
+            {"van Emde Boas, split", true, true}};
+    for (const auto& [name, veb, split] : layouts) {
+        std::string fn = "dataset/vp_layout.bin";
+        {
+            Builder b(d, fn);
+            b.setVebLayout(veb);
+            b.setSplitTopology(split);
+            fill_random_dataset(b, n, d);
+            b.build();
+        }
+        size_t coldFaults = 0;
+        gen.seed(1);
+        for (size_t q = 0; q<queries; q++) {
+            for (auto& x : query)
+                x = uni(gen);
+            for (const auto& f : {fn, fn+"_vec"}) {
+                int fd = open(f.c_str(), O_RDONLY);
+                if (fd >= 0) {
+                    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                    close(fd);
+                }
+            }
+            DiskVP vp(d, fn, squared_distance);
+            vp.openSortedFile();
+            size_t before = page_faults();
+            DiskVP::TopKSearch search(&vp, query.data(), k);
+            search.run();
+            coldFaults += page_faults() - before;
+            vp.closeSortedFile();
+        }
+
+        DiskVP vp(d, fn, squared_distance);
+        vp.openSortedFile();
+        for (size_t round = 0; round<2; round++) {
+            gen.seed(1);
+            auto start = std::chrono::steady_clock::now();
+            for (size_t q = 0; q<queries; q++) {
+                for (auto& x : query)
+                    x = uni(gen);
+                DiskVP::TopKSearch search(&vp, query.data(), k);
+                search.run();
+            }
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            if (round == 1)
+                std::cout << name << ": " << ((double)coldFaults)/queries
+                          << " cold page faults, " << elapsed.count()/queries << " ms per warm query" << std::endl;
+        }
+        vp.closeSortedFile();
+        unlink(fn.c_str());
+        unlink((fn+"_idx").c_str());
+        unlink((fn+"_vec").c_str());
+    }
+}
+
+/**
+ * Recall@k of the searches running over the quantized vectors, with and without the exact re-ranking of
+ * rerank candidates, against the exact search over the fp32 ones
+ */
+void vp_tree_quantization_benchmark(size_t n = 1000000, size_t d = 32, size_t k = 10, size_t queries = 1000, size_t rerank = 40) {
+    std::string fn = "dataset/vp_quantized.bin";
+    std::vector<std::pair<std::string, VectorCodec>> codecs{
+            {"fp16", CODEC_FP16},
+            {"bf16", CODEC_BF16},
+            {"int8", CODEC_INT8}};
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVP vp(d, fn, squared_distance);
+    vp.openSortedFile();
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<std::vector<float>> query(queries, std::vector<float>(d));
+    for (auto& q : query)
+        for (auto& x : q)
+            x = uni(gen);
+
+    std::vector<std::set<size_t>> truth(queries);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t q = 0; q<queries; q++) {
+        DiskVP::TopKSearch search(&vp, query[q].data(), k);
+        for (const auto& item : search.run())
+            truth[q].insert(item.item);
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "fp32: " << sizeof(float)*d << " bytes per vector, " << elapsed.count()/queries << " ms per query" << std::endl;
+
+    for (const auto& [name, codec] : codecs) {
+        vp.quantize(codec);
+        vp.openQuantized();
+        for (size_t candidates : {(size_t)0, rerank}) {
+            size_t found = 0;
+            start = std::chrono::steady_clock::now();
+            for (size_t q = 0; q<queries; q++) {
+                DiskVP::TopKSearch search(&vp, query[q].data(), k);
+                search.rerankCandidates = candidates;
+                for (const auto& item : search.run())
+                    found += truth[q].count(item.item);
+            }
+            elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << name << (candidates ? ", re-ranked" : "") << ": "
+                      << QuantizedVectors::bytes_per_dimension(codec)*d << " bytes per vector, recall@" << k << " "
+                      << ((double)found)/(queries*k) << ", " << elapsed.count()/queries << " ms per query" << std::endl;
+        }
+    }
+    vp.closeSortedFile();
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+    unlink((fn+"_q").c_str());
+}
+
+/**
+ * Recall@k and in-memory footprint of the PQ codes for several numbers of subspaces, with and without the
+ * exact re-ranking of rerank candidates
+ */
+void vp_tree_pq_benchmark(size_t n = 1000000, size_t d = 32, size_t k = 10, size_t queries = 1000, size_t rerank = 100) {
+    std::string fn = "dataset/vp_pq.bin";
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVP vp(d, fn, squared_distance);
+    vp.openSortedFile();
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<std::vector<float>> query(queries, std::vector<float>(d));
+    for (auto& q : query)
+        for (auto& x : q)
+            x = uni(gen);
+    std::vector<std::set<size_t>> truth(queries);
+    for (size_t q = 0; q<queries; q++) {
+        DiskVP::TopKSearch search(&vp, query[q].data(), k);
+        for (const auto& item : search.run())
+            truth[q].insert(item.item);
+    }
+
+    for (unsigned int subspaces : {d/8, d/4, d/2}) {
+        vp.train_pq(subspaces);
+        vp.openPQ();
+        for (size_t candidates : {(size_t)0, rerank}) {
+            size_t found = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t q = 0; q<queries; q++) {
+                DiskVP::TopKSearch search(&vp, query[q].data(), k);
+                search.rerankCandidates = candidates;
+                for (const auto& item : search.run())
+                    found += truth[q].count(item.item);
+            }
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "PQ " << subspaces << (candidates ? ", re-ranked" : "") << ": "
+                      << (vp.pq->codes.size() + sizeof(float)*vp.pq->centroids.size())/(1024*1024) << " MiB of codes, recall@" << k << " "
+                      << ((double)found)/(queries*k) << ", " << elapsed.count()/queries << " ms per query" << std::endl;
+        }
+    }
+    vp.closeSortedFile();
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+    unlink((fn+"_pq").c_str());
+}
+
+#include "vptree/BatchSearch.h"
+#include <thread>
+
+/**
+ * Throughput of a loop over TopKSearch, against BatchTopKSearch with and without the locality reordering,
+ * on one thread and on all of them
+ */
+void vp_tree_batch_benchmark(size_t n = 1000000, size_t d = 32, size_t k = 10, size_t queries = 10000) {
+    std::string fn = "dataset/vp_batch.bin";
+    {
+        Builder b(d, fn);
+        b.setLeafBucketSize(64);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVP vp(d, fn, squared_distance);
+    vp.openSortedFile();
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(queries*d);
+    for (auto& x : query)
+        x = uni(gen);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t q = 0; q<queries; q++) {
+        DiskVP::TopKSearch search(&vp, query.data()+q*d, k);
+        search.run();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "TopKSearch loop: " << queries/elapsed.count() << " queries/s" << std::endl;
+
+    size_t all = std::max(1U, std::thread::hardware_concurrency());
+    std::vector<std::tuple<std::string, size_t, bool>> configurations{
+            {"batch, 1 thread, input order", 1, false},
+            {"batch, 1 thread, Morton order", 1, true},
+            {"batch, "+std::to_string(all)+" threads, Morton order", all, true}};
+    for (const auto& [name, threads, reorder] : configurations) {
+        BatchTopKSearch batch(&vp, k, threads);
+        batch.reorder = reorder;
+        start = std::chrono::steady_clock::now();
+        batch.run(query.data(), queries);
+        elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << name << ": " << queries/elapsed.count() << " queries/s" << std::endl;
+    }
+    vp.closeSortedFile();
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+}
+
+#include "vptree/DiskVPReader.h"
+
+/**
+ * Throughput of top-k queries issued concurrently by an increasing number of threads against a single
+ * DiskVPReader
+ */
+void vp_tree_reader_benchmark(size_t n = 1000000, size_t d = 32, size_t k = 10, size_t queries = 10000) {
+    std::string fn = "dataset/vp_reader.bin";
+    {
+        Builder b(d, fn);
+        b.setLeafBucketSize(64);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVPReader reader(d, fn, squared_distance, METRIC_EUCLIDEAN);
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(queries*d);
+    for (auto& x : query)
+        x = uni(gen);
+    size_t all = std::max(1U, std::thread::hardware_concurrency());
+    for (size_t threads = 1; ; threads = std::min(2*threads, all)) {
+        std::vector<std::thread> workers;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t t = 0; t<threads; t++) {
+            workers.emplace_back([&reader, &query, t, threads, queries, d, k]() {
+                for (size_t q = t; q<queries; q += threads)
+                    reader.topK(query.data()+q*d, k);
+            });
+        }
+        for (auto& worker : workers)
+            worker.join();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << threads << " threads: " << queries/elapsed.count() << " queries/s" << std::endl;
+        if (threads == all)
+            break;
+    }
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+}
+
+/**
+ * Depth-first against best-first top-k traversals: distance computations and time per warm query, and page
+ * faults per cold query (the page cache is dropped and the file is mapped anew before each query)
+ */
+void vp_tree_best_first_benchmark(size_t n = 1000000, size_t d = 32, size_t k = 10, size_t queries = 200) {
+    std::string fn = "dataset/vp_best_first.bin";
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(queries*d);
+    for (auto& x : query)
+        x = uni(gen);
+    for (bool bestFirst : {false, true}) {
+        size_t coldFaults = 0;
+        for (size_t q = 0; q<queries; q++) {
+            int fd = open(fn.c_str(), O_RDONLY);
+            if (fd >= 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+            }
+            DiskVP vp(d, fn, squared_distance);
+            vp.openSortedFile();
+            size_t before = page_faults();
+            DiskVP::TopKSearch search(&vp, query.data()+q*d, k);
+            search.bestFirst = bestFirst;
+            search.run();
+            coldFaults += page_faults() - before;
+            vp.closeSortedFile();
+        }
+
+        DiskVP vp(d, fn, squared_distance);
+        vp.openSortedFile();
+        size_t visited = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t q = 0; q<queries; q++) {
+            DiskVP::TopKSearch search(&vp, query.data()+q*d, k);
+            search.bestFirst = bestFirst;
+            search.run();
+            visited += search.nodesVisited;
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << (bestFirst ? "best-first: " : "depth-first: ") << ((double)visited)/queries << " distances, "
+                  << ((double)coldFaults)/queries << " cold page faults, "
+                  << elapsed.count()/queries << " ms per warm query" << std::endl;
+        vp.closeSortedFile();
+    }
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+}
+
+#include <numeric>
+
+/**
+ * Recall@k against the exact search, mean and p99 latency, and share of partial results of the approximate
+ * searches: pruning slack, distance budget, and deadline
+ */
+void vp_tree_approximate_benchmark(size_t n = 1000000, size_t d = 32, size_t k = 10, size_t queries = 1000) {
+    std::string fn = "dataset/vp_approximate.bin";
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVP vp(d, fn, squared_distance);
+    vp.openSortedFile();
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(queries*d);
+    for (auto& x : query)
+        x = uni(gen);
+    std::vector<std::set<size_t>> truth(queries);
+    for (size_t q = 0; q<queries; q++) {
+        DiskVP::TopKSearch search(&vp, query.data()+q*d, k);
+        for (const auto& item : search.run())
+            truth[q].insert(item.item);
+    }
+
+    struct Setting {
+        std::string name;
+        float epsilon;
+        size_t maxDistances;
+        std::chrono::steady_clock::duration timeLimit;
+        bool bestFirst;
+    };
+    std::vector<Setting> settings{
+            {"exact", 0, 0, {}, false},
+            {"epsilon 0.5", 0.5, 0, {}, false},
+            {"epsilon 1", 1, 0, {}, false},
+            {"epsilon 2", 2, 0, {}, false},
+            {"1000 distances", 0, 1000, {}, false},
+            {"5000 distances", 0, 5000, {}, false},
+            {"20000 distances", 0, 20000, {}, false},
+            {"1000 distances, best-first", 0, 1000, {}, true},
+            {"5000 distances, best-first", 0, 5000, {}, true},
+            {"20000 distances, best-first", 0, 20000, {}, true},
+            {"deadline 0.5 ms", 0, 0, std::chrono::microseconds(500), false},
+            {"deadline 2 ms", 0, 0, std::chrono::microseconds(2000), false},
+            {"deadline 0.5 ms, best-first", 0, 0, std::chrono::microseconds(500), true},
+            {"deadline 2 ms, best-first", 0, 0, std::chrono::microseconds(2000), true}};
+    for (const auto& setting : settings) {
+        size_t found = 0, partial = 0;
+        std::vector<double> latency(queries);
+        for (size_t q = 0; q<queries; q++) {
+            auto start = std::chrono::steady_clock::now();
+            DiskVP::TopKSearch search(&vp, query.data()+q*d, k);
+            search.epsilon = setting.epsilon;
+            search.maxDistances = setting.maxDistances;
+            search.timeLimit = setting.timeLimit;
+            search.bestFirst = setting.bestFirst;
+            auto result = search.run();
+            latency[q] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            for (const auto& item : result)
+                found += truth[q].count(item.item);
+            partial += search.partial;
+        }
+        double mean = std::accumulate(latency.begin(), latency.end(), 0.0) / queries;
+        std::sort(latency.begin(), latency.end());
+        std::cout << setting.name << ": recall " << ((double)found)/(queries*k) << ", " << mean << " ms mean, "
+                  << latency[(queries*99)/100] << " ms p99, " << ((double)partial)/queries << " partial" << std::endl;
+    }
+    vp.closeSortedFile();
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+}
+
+/**
+ * Broad range query matching most of the dataset: time to the first result and overall, for the materialised
+ * MaxDistanceSearch and the lazy lookUpNearsetTo, alongside the growth of the peak resident memory
+ */
+void vp_tree_range_cursor_benchmark(size_t n = 1000000, size_t d = 8, double maxDistance = 1.0) {
+    std::string fn = "dataset/vp_range_cursor.bin";
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVP vp(d, fn, squared_distance);
+    vp.openSortedFile();
+    std::vector<float> query(d, 0.5);
+    auto peak = []() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return (size_t)usage.ru_maxrss;
+    };
+    {
+        size_t before = peak();
+        auto start = std::chrono::steady_clock::now();
+        auto cursor = vp.lookUpNearsetTo(query.data(), maxDistance);
+        size_t count = 0;
+        double first = 0;
+        for (auto it = cursor.begin(); it != cursor.end(); ++it) {
+            if (count++ == 0)
+                first = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "lookUpNearsetTo: " << count << " results, first after " << first << " ms, all after "
+                  << elapsed.count() << " ms, +" << peak() - before << " KB peak memory" << std::endl;
+    }
+    {
+        size_t before = peak();
+        auto start = std::chrono::steady_clock::now();
+        DiskVP::MaxDistanceSearch search(&vp, query.data(), maxDistance);
+        auto result = search.run();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "MaxDistanceSearch: " << result.size() << " results, all (and first) after "
+                  << elapsed.count() << " ms, +" << peak() - before << " KB peak memory" << std::endl;
+    }
+    vp.closeSortedFile();
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+}
+
+/**
+ * Distance computations and time per range query, for increasing radii
+ */
+void vp_tree_range_benchmark(size_t n = 1000000, size_t d = 8, size_t queries = 100) {
+    std::string fn = "dataset/vp_range.bin";
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVP vp(d, fn, squared_distance);
+    vp.openSortedFile();
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(queries*d);
+    for (auto& x : query)
+        x = uni(gen);
+    for (double maxDistance : {0.1, 0.2, 0.4, 0.8}) {
+        size_t visited = 0, found = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t q = 0; q<queries; q++) {
+            DiskVP::MaxDistanceSearch search(&vp, query.data()+q*d, maxDistance);
+            found += search.run().size();
+            visited += search.nodesVisited;
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "radius " << maxDistance << ": " << ((double)found)/queries << " results, "
+                  << ((double)visited)/queries << " distances, " << elapsed.count()/queries << " ms per query" << std::endl;
+    }
+    vp.closeSortedFile();
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+}
+
+#include "vptree/SimilarityJoin.h"
+
+/**
+ * Self-join within maxDistance: one range query per element against the similarity join, sequential and
+ * parallel, with the pairs written to a disk-backed sink
+ */
+void vp_tree_similarity_join_benchmark(size_t n = 1000000, size_t d = 8, double maxDistance = 0.05) {
+    std::string fn = "dataset/vp_join.bin";
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVP vp(d, fn, squared_distance);
+    vp.openSortedFile();
+    {
+        size_t pairs = 0, visited = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t id = 0; id<n; id++) {
+            DiskVP::MaxDistanceSearch search(&vp, id, maxDistance);
+            search.sorted = false;
+            for (const auto& item : search.run())
+                pairs += item.item > id;
+            visited += search.nodesVisited;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "range queries: " << pairs << " pairs, " << visited << " distances, " << elapsed.count() << " s" << std::endl;
+    }
+    size_t all = std::max(1U, std::thread::hardware_concurrency());
+    for (size_t threads : {(size_t)1, all}) {
+        StxxlJoinSink sink;
+        SimilarityJoin join(&vp, maxDistance, threads);
+        auto start = std::chrono::steady_clock::now();
+        join.run(sink);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "similarity join, " << threads << " threads: " << join.pairsFound << " pairs, "
+                  << join.distanceComputations << " distances, " << elapsed.count() << " s" << std::endl;
+    }
+    vp.closeSortedFile();
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+}
+
+#include "vptree/KnnGraph.h"
+
+/**
+ * k-nearest-neighbour graph of the whole dataset: one TopKSearch per id, in id order, against the graph builder,
+ * sequential and parallel, with and without the parent seeding
+ */
+void vp_tree_knn_graph_benchmark(size_t n = 1000000, size_t d = 8, size_t k = 10) {
+    std::string fn = "dataset/vp_knn.bin";
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVP vp(d, fn, squared_distance);
+    vp.openSortedFile();
+    {
+        size_t visited = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t id = 0; id<n; id++) {
+            DiskVP::TopKSearch search(&vp, id, k+1);
+            search.run();
+            visited += search.nodesVisited;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "TopKSearch per id: " << ((double)visited)/n << " distances per element, " << elapsed.count() << " s" << std::endl;
+    }
+    size_t all = std::max(1U, std::thread::hardware_concurrency());
+    for (size_t threads : {(size_t)1, all}) {
+        for (bool seed : {false, true}) {
+            KnnGraphBuilder builder(&vp, k, threads);
+            builder.seedFromParent = seed;
+            auto start = std::chrono::steady_clock::now();
+            builder.build(fn+"_graph");
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "graph builder, " << threads << " threads" << (seed ? ", seeded: " : ": ")
+                      << ((double)builder.distanceComputations)/n << " distances per element, " << elapsed.count() << " s" << std::endl;
+        }
+    }
+    vp.closeSortedFile();
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+    unlink((fn+"_graph").c_str());
+}
+
+/**
+ * Latency of the top-k searches with and without the access hints and the prefetching of the children:
+ * per cold query (the page cache is dropped and the file is mapped anew before each query), and per warm query
+ */
+void vp_tree_prefetch_benchmark(size_t n = 1000000, size_t d = 32, size_t k = 10, size_t queries = 200) {
+    std::string fn = "dataset/vp_prefetch.bin";
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(queries*d);
+    for (auto& x : query)
+        x = uni(gen);
+    // Name, access hint, prefetch into the cache, and asynchronous read of the children's pages
+    std::vector<std::tuple<std::string, mmap_advice, bool, bool>> settings{
+            {"no hints", MMAP_NORMAL, false, false},
+            {"prefetch", MMAP_NORMAL, true, false},
+            {"prefetch + MADV_WILLNEED", MMAP_NORMAL, true, true},
+            {"MADV_RANDOM + prefetch", MMAP_RANDOM, true, false},
+            {"MADV_RANDOM + prefetch + MADV_WILLNEED", MMAP_RANDOM, true, true}};
+    auto configure = [](DiskVP& vp, mmap_advice advice, bool prefetch, bool willNeed) {
+        vp.accessAdvice = advice;
+        vp.prefetchNodes = prefetch;
+        vp.willNeedNodes = willNeed;
+        vp.openSortedFile();
+    };
+    for (const auto& [name, advice, prefetch, willNeed] : settings) {
+        size_t coldFaults = 0;
+        std::chrono::duration<double, std::milli> cold{0};
+        for (size_t q = 0; q<queries; q++) {
+            int fd = open(fn.c_str(), O_RDONLY);
+            if (fd >= 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+            }
+            DiskVP vp(d, fn, squared_distance);
+            configure(vp, advice, prefetch, willNeed);
+            size_t before = page_faults();
+            auto start = std::chrono::steady_clock::now();
+            DiskVP::TopKSearch search(&vp, query.data()+q*d, k);
+            search.run();
+            cold += std::chrono::steady_clock::now() - start;
+            coldFaults += page_faults() - before;
+            vp.closeSortedFile();
+        }
+
+        DiskVP vp(d, fn, squared_distance);
+        configure(vp, advice, prefetch, willNeed);
+        std::chrono::duration<double, std::milli> warm{0};
+        for (size_t round = 0; round<2; round++) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t q = 0; q<queries; q++) {
+                DiskVP::TopKSearch search(&vp, query.data()+q*d, k);
+                search.run();
+            }
+            warm = std::chrono::steady_clock::now() - start;
+        }
+        std::cout << name << ": " << cold.count()/queries << " ms and " << ((double)coldFaults)/queries
+                  << " page faults per cold query, " << warm.count()/queries << " ms per warm query" << std::endl;
+        vp.closeSortedFile();
+    }
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+}
+
+#include "vptree/MVPTree.h"
+
+void mvp_tree_benchmark(size_t n = 200000, size_t d = 32, size_t k = 10, size_t queries = 1000) {
+    std::string fn = "dataset/vp_mvp.bin";
+    {
+        Builder b(d, fn);
+        fill_random_dataset(b, n, d);
+        b.build();
+    }
+    DiskVP vp(d, fn, squared_distance);
+    vp.openSortedFile();
+    MVPTree mvp(&vp, fn+"_mvp");
+    mvp.build();
+    mvp.openFile();
+    std::mt19937_64 gen{1};
+    std::uniform_real_distribution<float> uni(0.0, 1.0);
+    std::vector<float> query(d);
+    size_t vpDistances = 0, mvpDistances = 0;
+    for (size_t q = 0; q<queries; q++) {
+        for (auto& x : query)
+            x = uni(gen);
+        DiskVP::TopKSearch vpSearch(&vp, query.data(), k);
+        vpSearch.run();
+        vpDistances += vpSearch.nodesVisited;
+        MVPTree::TopKSearch mvpSearch(&mvp, query.data(), k);
+        mvpSearch.run();
+        mvpDistances += mvpSearch.distanceComputations;
+    }
+    std::cout << "VP-tree: " << ((double)vpDistances)/queries << " distances per query" << std::endl;
+    std::cout << "MVP-tree: " << ((double)mvpDistances)/queries << " distances per query" << std::endl;
+    mvp.closeFile();
+    vp.closeSortedFile();
+    unlink(fn.c_str());
+    unlink((fn+"_idx").c_str());
+    unlink((fn+"_mvp").c_str());
+}
+
 #include <bktree/BKTreeDisk.h>
 
 void bktree_test() {
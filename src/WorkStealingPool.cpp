@@ -0,0 +1,121 @@
+/*
+ * WorkStealingPool.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "WorkStealingPool.h"
+
+// Pool and queue owned by the current worker thread, if any
+static thread_local const WorkStealingPool* workerPool = nullptr;
+static thread_local size_t workerQueue = 0;
+
+WorkStealingPool::WorkStealingPool(size_t nThreads) : stopping{false}, queued{0} {
+    if (nThreads == 0)
+        nThreads = 1;
+    for (size_t i = 0; i<nThreads; i++)
+        queues.emplace_back(std::make_unique<WorkerQueue>());
+    for (size_t i = 1; i<nThreads; i++)
+        workers.emplace_back([this, i]() { workerLoop(i); });
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    sleepCondition.notify_all();
+    for (auto& t : workers)
+        t.join();
+}
+
+size_t WorkStealingPool::currentQueue() const {
+    return (workerPool == this) ? workerQueue : 0;
+}
+
+void WorkStealingPool::submit(TaskGroup &group, std::function<void()> task) {
+    group.pending++;
+    auto& q = *queues[currentQueue()];
+    {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.tasks.push_back(Task{std::move(task), &group});
+    }
+    queued++;
+    {
+        // Acquiring the lock so that a worker cannot miss the notification between its check and its sleep
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    sleepCondition.notify_one();
+}
+
+bool WorkStealingPool::runOne(size_t self) {
+    Task task;
+    bool found = false;
+    {
+        auto& q = *queues[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty()) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            found = true;
+        }
+    }
+    for (size_t i = 1, N = queues.size(); (!found) && (i<N); i++) {
+        auto& q = *queues[(self + i) % N];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty()) {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            found = true;
+        }
+    }
+    if (!found)
+        return false;
+    queued--;
+    try {
+        task.fn();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(task.group->errorMutex);
+        if (!task.group->error)
+            task.group->error = std::current_exception();
+    }
+    task.group->pending--;
+    return true;
+}
+
+void WorkStealingPool::wait(TaskGroup &group) {
+    auto self = currentQueue();
+    while (group.pending.load() > 0) {
+        if (!runOne(self))
+            std::this_thread::yield();
+    }
+    if (group.error)
+        std::rethrow_exception(group.error);
+}
+
+void WorkStealingPool::workerLoop(size_t self) {
+    workerPool = this;
+    workerQueue = self;
+    while (true) {
+        if (runOne(self))
+            continue;
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCondition.wait(lock, [this]() { return stopping.load() || queued.load() > 0; });
+        if (stopping && queued.load() == 0)
+            return;
+    }
+}
@@ -101,6 +101,51 @@ void* mmapFile(std::string file, unsigned long* size, mmap_file* fd) {
 }
 
 
+const void* mmapFileReadOnly(std::string file, unsigned long* size, mmap_file* fd) {
+#ifdef _MSC_VER
+    TCHAR *lpFileName = file.data();
+    LARGE_INTEGER liFileSize;
+    fd->hFile = CreateFile(lpFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (fd->hFile == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "CreateFile failed with error %d\n", GetLastError());
+        return nullptr;
+    }
+    if ((!GetFileSizeEx(fd->hFile, &liFileSize)) || (liFileSize.QuadPart == 0)) {
+        CloseHandle(fd->hFile);
+        return nullptr;
+    }
+    fd->hMap = CreateFileMapping(fd->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (fd->hMap == 0) {
+        CloseHandle(fd->hFile);
+        return nullptr;
+    }
+    LPVOID lpBasePtr = MapViewOfFile(fd->hMap, FILE_MAP_READ, 0, 0, 0);
+    if (lpBasePtr == NULL) {
+        CloseHandle(fd->hMap);
+        CloseHandle(fd->hFile);
+        return nullptr;
+    }
+    fd->len = *size = liFileSize.QuadPart;
+    return lpBasePtr;
+#else
+    struct stat filestatus;
+    if (stat(file.c_str(), &filestatus) != 0)
+        return nullptr;
+    *size = filestatus.st_size;
+    fd->len = *size;
+    fd->fd = open(file.c_str(), O_RDONLY);
+    if (fd->fd == -1)
+        return nullptr;
+    void* addr = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd->fd, 0);
+    if (addr == MAP_FAILED) {
+        std::cout << strerror(errno) << std::endl;
+        close(fd->fd);
+        return nullptr;
+    }
+    return addr;
+#endif
+}
+
 void mmapClose(void* ptr, mmap_file* fd) {
 #ifdef _MSC_VER
     UnmapViewOfFile(ptr);
@@ -115,6 +160,25 @@ void mmapClose(void* ptr, mmap_file* fd) {
 #endif
 }
 
+void mmapAdvise(const void* ptr, unsigned long len, mmap_advice advice) {
+#ifndef _MSC_VER
+    if ((!ptr) || (len == 0))
+        return;
+    static const uintptr_t page = sysconf(_SC_PAGE_SIZE);
+    // madvise requires the range to start at a page boundary
+    uintptr_t first = (uintptr_t)ptr & ~(page-1);
+    len += (uintptr_t)ptr - first;
+    int flag = MADV_NORMAL;
+    switch (advice) {
+        case MMAP_RANDOM: flag = MADV_RANDOM; break;
+        case MMAP_SEQUENTIAL: flag = MADV_SEQUENTIAL; break;
+        case MMAP_WILLNEED: flag = MADV_WILLNEED; break;
+        default: break;
+    }
+    madvise((void*)first, len, flag);
+#endif
+}
+
 size_t availableMemory() {
 #ifdef _MSC_VER
     MEMORYSTATUSEX status;
@@ -0,0 +1,207 @@
+/*
+ * BatchSearch.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vptree/BatchSearch.h"
+#include "WorkStealingPool.h"
+#include "vptree/VectorBlock.h"
+#include "MortonLUT.h"
+#include <atomic>
+
+static_assert(BatchTopKSearch::MAX_BLOCK == VectorBlock::MAX_BLOCK, "the queries of a block are a VectorBlock");
+
+/**
+ * Queries of a block, alongside their own top-k state
+ */
+struct BatchTopKSearch::Block : VectorBlock {
+    std::vector<std::priority_queue<DiskVP::HeapItem>> heaps;
+    std::vector<float> tau;
+
+    Block(const float* queries, const size_t* order, size_t count, size_t d) :
+            VectorBlock(d), heaps(count), tau(count, std::numeric_limits<float>::max()) {
+        for (size_t q = 0; q<count; q++)
+            add(queries + order[q]*d);
+        transpose();
+    }
+
+    /**
+     * Same as TopKSearch::offer, for the q-th query of the block
+     */
+    inline void offer(size_t q, size_t k, size_t id, float dist) {
+        auto& heap = heaps[q];
+        if (definitelyLessThan(dist, tau[q])) {
+            heap.push(DiskVP::HeapItem{id, dist});
+            if (heap.size() > k)
+                heap.pop();
+            if (heap.size() == k)
+                tau[q] = heap.top().dist;
+        } else if (approximatelyEqual(dist, tau[q])) {
+            heap.push(DiskVP::HeapItem{id, dist});
+            if (heap.size() > k)
+                heap.pop();
+            if (heap.size() == k)
+                tau[q] = heap.top().dist;
+            tau[q] = std::min(heap.top().dist, tau[q]);
+        }
+    }
+};
+
+size_t BatchTopKSearch::run_block(const float* queries, const size_t* order, size_t count,
+                                  std::vector<std::vector<DiskVP::HeapItem>>& results) const {
+    Block block(queries, order, count, vp->d);
+    size_t visited = 0;
+    const uint64_t all = block.all();
+    // Position of each subtree root, the last position of the subtree, and the queries visiting it
+    std::stack<std::tuple<size_t,size_t,uint64_t>> s;
+    if (vp->size() > 0)
+        s.emplace(0, vp->size()-1, all);
+    while (!s.empty()) {
+        auto [pos, last, mask] = s.top();
+        s.pop();
+        auto root = vp->getEntryPoint(pos);
+        if (root->isLeaf) {
+            for (size_t i = pos, end = vp->bucket_last(pos, root, last); i<=end; i++) {
+                auto entry = vp->getEntryPoint(i);
+                if (vp->isDeleted(entry->id))
+                    continue;
+                visited++;
+                block.distances(vp, vp->getPTR(i), mask);
+                for (uint64_t m = mask; m; m &= m-1) {
+                    size_t q = __builtin_ctzll(m);
+                    block.offer(q, k, entry->id, block.dist[q]);
+                }
+            }
+            continue;
+        }
+        visited++;
+        double rootRadius = root->radius;
+        vp->prefetch_children(root);
+        block.distances(vp, vp->getPTR(pos), mask);
+        bool deleted = vp->isDeleted(root->id);
+        bool hasLeft = root->leftChild != DiskVP::NO_CHILD, hasRight = root->rightChild != DiskVP::NO_CHILD;
+        uint64_t left = 0, right = 0;
+        size_t inside = 0;
+        for (uint64_t m = mask; m; m &= m-1) {
+            size_t q = __builtin_ctzll(m);
+            float dist = block.dist[q];
+            if (!deleted)
+                block.offer(q, k, root->id, dist);
+            // Inner/outer shell test against each query's tau when the children are pushed. Differently from
+            // TopKSearch, a popped subtree is not re-checked against the tau shrunk in the meantime, as that would
+            // take a bound per query within each stack entry
+            float tau = block.tau[q];
+            if (hasLeft && dist - tau <= rootRadius)
+                left |= 1ULL << q;
+            if (hasRight && dist + tau >= rootRadius)
+                right |= 1ULL << q;
+            if (dist < rootRadius)
+                inside++;
+        }
+        std::tuple<size_t,size_t,uint64_t> l{root->leftChild, hasRight ? root->rightChild-1 : last, left};
+        std::tuple<size_t,size_t,uint64_t> r{root->rightChild, last, right};
+        // The subtree most of the queries fall within is visited first
+        if (2*inside >= (size_t)__builtin_popcountll(mask)) {
+            if (right) s.push(r);
+            if (left) s.push(l);
+        } else {
+            if (left) s.push(l);
+            if (right) s.push(r);
+        }
+    }
+
+    for (size_t q = 0; q<count; q++) {
+        auto& result = results[order[q]];
+        auto& heap = block.heaps[q];
+        result.clear();
+        while (!heap.empty()) {
+            result.emplace_back(heap.top());
+            heap.pop();
+        }
+        std::reverse(result.begin(), result.end());
+    }
+    return visited;
+}
+
+std::vector<size_t> BatchTopKSearch::locality_order(const float* queries, size_t n) const {
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i<n; i++)
+        order[i] = i;
+    if (vp->size() == 0)
+        return order;
+
+    // The root vantage point and its children: the first nodes each query is compared with
+    std::vector<size_t> pivots{0};
+    auto root = vp->getEntryPoint(0);
+    if (root->isLeaf) {
+        for (size_t i = 1; (i<vp->size()) && (i<3); i++)
+            pivots.emplace_back(i);
+    } else {
+        if (root->leftChild != DiskVP::NO_CHILD)
+            pivots.emplace_back(root->leftChild);
+        if (root->rightChild != DiskVP::NO_CHILD)
+            pivots.emplace_back(root->rightChild);
+    }
+    const size_t d = vp->d;
+    std::vector<float> dist(n*3, 0);
+    float maxDist[3]{0, 0, 0};
+    for (size_t i = 0; i<n; i++) {
+        for (size_t p = 0; p<pivots.size(); p++) {
+            float x = vp->ker(d, vp->getPTR(pivots[p]), (float*)queries + i*d);
+            dist[i*3+p] = x;
+            maxDist[p] = std::max(maxDist[p], x);
+        }
+    }
+
+    static constexpr mortonnd::MortonNDLutEncoder_3D_64 encoder;
+    constexpr double fieldMax = (1U << 21) - 1;
+    std::vector<uint64_t> code(n);
+    for (size_t i = 0; i<n; i++) {
+        uint64_t field[3];
+        for (size_t p = 0; p<3; p++)
+            field[p] = (maxDist[p] > 0) ? (uint64_t)(dist[i*3+p] / maxDist[p] * fieldMax) : 0;
+        code[i] = encoder.Encode(field[0], field[1], field[2]);
+    }
+    std::sort(order.begin(), order.end(), [&code](size_t l, size_t r) {
+        return (code[l] < code[r]) || ((code[l] == code[r]) && (l < r));
+    });
+    return order;
+}
+
+std::vector<std::vector<DiskVP::HeapItem>> BatchTopKSearch::run(const float* queries, size_t n) {
+    std::vector<std::vector<DiskVP::HeapItem>> results(n);
+    std::vector<size_t> order;
+    if (reorder) {
+        order = locality_order(queries, n);
+    } else {
+        order.resize(n);
+        for (size_t i = 0; i<n; i++)
+            order[i] = i;
+    }
+    std::atomic<size_t> visited{0};
+    WorkStealingPool pool(threads);
+    WorkStealingPool::TaskGroup group;
+    for (size_t first = 0; first<n; first += blockSize) {
+        pool.submit(group, [this, queries, &order, &results, &visited, first, n]() {
+            visited += run_block(queries, order.data()+first, std::min(blockSize, n-first), results);
+        });
+    }
+    pool.wait(group);
+    nodesVisited = visited;
+    return results;
+}
@@ -24,19 +24,97 @@
 //
 
 #include "vptree/DiskVP.h"
+#include "WorkStealingPool.h"
 #include <string.h>
+#include <numeric>
 
 void DiskVP::recursive_restruct_tree(size_t first, size_t last) {
-    if (first >= last) {
-        updateNode(index[first],0, std::numeric_limits<unsigned int>::max(), std::numeric_limits<unsigned int>::max(), false);
+    size_t rc;
+    if (restruct_node(first, last, rc)) {
+        // Recursively splitting in half the elements within my radius and the ones out
+        recursive_restruct_tree(first+1, rc-1);
+        recursive_restruct_tree(rc, last);
+    }
+}
+
+void DiskVP::parallel_restruct_tree(size_t first, size_t last) {
+    WorkStealingPool pool(threads);
+    parallel_restruct_tree(pool, first, last);
+}
+
+void DiskVP::parallel_restruct_tree(WorkStealingPool& pool, size_t first, size_t last) {
+    if ((first >= last) || (last - first < parallelGrain)) {
+        // Not worth spawning further tasks: each task then runs a sequential restructuring on its own
+        recursive_restruct_tree(first, last);
+        return;
+    }
+    size_t rc;
+    if (restruct_node(first, last, rc)) {
+        WorkStealingPool::TaskGroup group;
+        pool.submit(group, [this, &pool, first, rc]() {
+            parallel_restruct_tree(pool, first+1, rc-1);
+        });
+        parallel_restruct_tree(pool, rc, last);
+        pool.wait(group);
+    }
+}
+
+/**
+ * Computes, once, the distance between from and each element in [begin, last] of the shuffled index, storing it
+ * within a per-thread scratch memory alongside the element. Ties are broken by the element id, so that the
+ * ordering is total and the resulting tree does not depend on the sorting algorithm's implementation.
+ */
+static std::vector<std::pair<float, size_t>>& materialise_distances(const DiskVP& vp, float* from, size_t begin, size_t last) {
+    static thread_local std::vector<std::pair<float, size_t>> scratch;
+    scratch.clear();
+    scratch.reserve(last - begin + 1);
+    for (size_t i = begin; i<=last; i++)
+        scratch.emplace_back(vp.ker(vp.d, from, vp.getSPTR(i)), vp.index[i]);
+    return scratch;
+}
+
+size_t DiskVP::select_max_spread_root(size_t first, size_t last, SplitMix64& rng) const {
+    std::uniform_int_distribution<size_t> uni(first, last);
+    std::vector<size_t> sample(vpSamples);
+    for (auto& x : sample)
+        x = uni(rng);
+    size_t best = first;
+    double bestSpread = -1.0;
+    for (size_t c = 0; c<vpCandidates; c++) {
+        size_t candidate = uni(rng);
+        auto cptr = getSPTR(candidate);
+        double sum = 0.0, sumSq = 0.0;
+        for (size_t x : sample) {
+            double dist = ker(d, cptr, getSPTR(x));
+            sum += dist;
+            sumSq += dist*dist;
+        }
+        double mean = sum / sample.size();
+        double spread = sumSq / sample.size() - mean*mean;
+        if (spread > bestSpread) {
+            bestSpread = spread;
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+bool DiskVP::restruct_node(size_t first, size_t last, size_t& rc) {
+    if ((leafBucketSize > 1) && (last - first + 1 <= leafBucketSize)) {
+        // The whole subtree becomes a single leaf bucket, which is scanned linearly by the searches
+        updateNode(index[first], 0, NO_CHILD, NO_CHILD, true);
+        return false;
+    } else if (first >= last) {
+        updateNode(index[first],0, NO_CHILD, NO_CHILD, false);
+        return false;
     } else {
         if ((last - first) <= 1) {
-            updateNode(index[first], ker(d, (float*)getSPTR(first), (float*)getSPTR(last)), last, std::numeric_limits<unsigned int>::max(), false);
+            updateNode(index[first], ker(d, (float*)getSPTR(first), (float*)getSPTR(last)), last, NO_CHILD, false);
+            return false;
         } else {
-            size_t root;
-            size_t median;
+            size_t root = first;
             bool doBalanced;
-            if (doBalancedSorting != RANDOM_ROOT_UNBALANCED) {
+            if ((doBalancedSorting != RANDOM_ROOT_UNBALANCED) && (doBalancedSorting != SAMPLED_ROOT_MAX_SPREAD)) {
                 if (blockade!=-1) {
                     doBalanced = (last-first)/2>blockade;
                 } else {
@@ -45,21 +123,23 @@ void DiskVP::recursive_restruct_tree(size_t first, size_t last) {
             } else {
                 doBalanced = false;
             }
+            // Each node owns its random number generator, so that it is not shared across the tasks
+            SplitMix64 rng{seed ^ (first * 0xD1B54A32D192ED03ULL)};
             if (doBalanced) {
-                memset(ptrMemory, 0, sizeof(float)*d);
-                for (size_t i = first; i<last; i++) {
-                    const float* memo = getSPTR(first);
+                // Per-node scratch memory, as concurrent tasks cannot share a single buffer
+                std::vector<float> memory(d, 0.0f);
+                float* ptrMemory = memory.data();
+                for (size_t i = first; i<=last; i++) {
+                    const float* memo = getSPTR(i);
                     for (size_t j = 0; j<d; j++)
                         ptrMemory[j] += memo[j];
                 }
-                std::sort(index.begin()+first, index.begin()+last, [this](size_t l, size_t r) {
-                    auto lptr = getPTR(l);
-                    auto rptr = getPTR(r);
-                    auto dr = ker(d, ptrMemory, (float*)rptr);
-                    auto dl = ker(d, ptrMemory, (float*)lptr);
-                    return dl < dr;
-                });
-                bool requireResorting = false;
+                for (size_t j = 0; j<d; j++)
+                    ptrMemory[j] /= (float)(last - first + 1);
+                auto& scratch = materialise_distances(*this, ptrMemory, first, last);
+                std::sort(scratch.begin(), scratch.end());
+                for (size_t i = 0, N = scratch.size(); i<N; i++)
+                    index[first+i] = scratch[i].second;
                 if ((blockade != -1) && (first+blockade<last)) {
                     switch (doBalancedSorting) {
                         case BALANCED_ROOT_IS_GEOMETRIC_MEDIAN:
@@ -68,95 +148,551 @@ void DiskVP::recursive_restruct_tree(size_t first, size_t last) {
 
                         case BALANCED_ROOT_IS_HALFWAY_BLOCKADE:
                             root = first+(blockade/2);
-                            median = (first + last) / 2;
-                            requireResorting = true;
                             break;
 
                         case RANDOM_ROOT_UNBALANCED:
+                        case SAMPLED_ROOT_MAX_SPREAD:
+                            // Both strategies never balance the nodes (see doBalanced)
                             throw std::runtime_error("ERROR: this should never happen");
                     }
-                } else {
-                    root = first;
-                }
-                std::swap(index[first], index[root]);
-                if (requireResorting) {
-                    auto fptr = getSPTR(first);
-                    /*
-                     * nth_element is a partial sorting algorithm that rearranges elements in [first, last) such that:
-                     *
-                     * - The element pointed at by median is changed to whatever element would occur in that position if [first, last) were sorted.
-                     * - All the elements before this new nth element are less than or equal to the elements after the new nth element.
-                     */
-                    std::nth_element(
-                            index.begin() + first + 1,//first
-                            index.begin() + median,   //median
-                            index.begin() + last,    //last
-                            [fptr,this] (size_t l, size_t r) {
-                                auto lptr = getPTR(l);
-                                auto rptr = getPTR(r);
-                                auto dr = ker(d, fptr, (float*)rptr);
-                                auto dl = ker(d, fptr, (float*)lptr);
-                                return dl < dr;
-                            });
                 }
+            } else if ((doBalancedSorting == SAMPLED_ROOT_MAX_SPREAD) &&
+                       (last - first + 1 >= vpCandidates * vpSamples)) {
+                // Sampling only when the selection costs no more than the partitioning itself
+                root = select_max_spread_root(first, last, rng);
             } else {
-                std::uniform_int_distribution<size_t> uni(first, last - 1);
+                std::uniform_int_distribution<size_t> uni(first, last);
                 root = uni(rng);
-                std::swap(index[first], index[root]);
-                if ((blockade != -1) && (first+blockade<last)) {
-                    median = blockade;
-                } else {
-                    median = (first + last) / 2;
-                }
-                auto fptr = getSPTR(first);
-                /*
-                 * nth_element is a partial sorting algorithm that rearranges elements in [first, last) such that:
-                 *
-                 * - The element pointed at by median is changed to whatever element would occur in that position if [first, last) were sorted.
-                 * - All the elements before this new nth element are less than or equal to the elements after the new nth element.
-                 */
-                std::nth_element(
-                        index.begin() + first + 1,//first
-                        index.begin() + median,   //median
-                        index.begin() + last,    //last
-                        [fptr, first,this] (size_t l, size_t r) {
-                            auto lptr = getPTR(l);
-                            auto rptr = getPTR(r);
-                            auto dr = ker(d, fptr, (float*)rptr);
-                            auto dl = ker(d, fptr, (float*)lptr);
-                            return dl < dr;
-                        });
             }
-            auto tree_median = getSPTR(median);
+            std::swap(index[first], index[root]);
+
+            // The children are [first+1, rc-1] and [rc, last], so the split always happens at the median
+            size_t median = (first + last) / 2;
+            rc = median + 1;
+            auto& scratch = materialise_distances(*this, getSPTR(first), first+1, last);
+            auto nth = scratch.begin() + (median - first - 1);
+            std::nth_element(scratch.begin(), nth, scratch.end());
+            for (size_t i = 0, N = scratch.size(); i<N; i++)
+                index[first+1+i] = scratch[i].second;
 
-            // Setting the separating elements
-            auto radius = ker(d, (float*) getSPTR(first), (float*)tree_median);
-            updateNode(index[first], radius, first+1,(first + last) / 2 + 1, false );
+            // The radius is the (cached) distance of the farthest element within the left subtree
+            float radius = nth->first;
+            updateNode(index[first], radius, first+1, rc, false );
             if ((doBalanced) && (blockade != -1)) {
                 // In this case, it means that I found an entry-point node for the search!
-                blockade_elements.emplace_back(index[root], radius);
+                std::lock_guard<std::mutex> lock(blockadeMutex);
+                blockade_elements.emplace_back(index[first], radius);
             }
+            return true;
+        }
+    }
+}
+
+// Size of the staging buffer used by the bulk ingestion
+#define BULK_CHUNK_SIZE     (8*1024*1024)
+
+void DiskVP::write_entries_to_disk(const float *rows, size_t n) {
+    if (n == 0)
+        return;
+    start_write_to_disk();
+    // Writing the pending stdio data, so that pwrite can write the records right after it
+    fflush(myfile);
+    int fd = fileno(myfile);
+    const size_t recordSize = record_size();
+    const size_t chunkRecords = std::max((size_t)1, (size_t)BULK_CHUNK_SIZE / recordSize);
+    std::vector<char> staging(std::min(n, chunkRecords) * recordSize);
+    off_t offset = dataOffset + recordSize*idx;
+    index.reserve(idx + n);
 
-            // Recursively splitting in half the elements within my radius and the ones out
-            size_t rc = (first + last) / 2 + 1;
-            recursive_restruct_tree(first+1, rc-1);
-            recursive_restruct_tree(rc, last);
+    for (size_t done = 0; done < n; ) {
+        size_t m = std::min(n - done, chunkRecords);
+        memset(staging.data(), 0, m * recordSize);
+        for (size_t i = 0; i<m; i++) {
+            auto header = (disk_vp_node_header*)(staging.data() + i*recordSize);
+            header->id = idx;
+            header->radius = 0;
+            header->leftChild = header->rightChild = NO_CHILD;
+            header->isLeaf = false;
+            memcpy(staging.data() + i*recordSize + vectorOffset, rows + (done+i)*d, sizeof(float)*d);
+            index.emplace_back(idx);
+            idx++;
         }
+        const char* buf = staging.data();
+        size_t len = m * recordSize;
+        while (len > 0) {
+            ssize_t written = pwrite(fd, buf, len, offset);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("ERROR: bulk write failed: " + std::string(strerror(errno)));
+            }
+            buf += written;
+            offset += written;
+            len -= written;
+        }
+        done += m;
+    }
+    // Moving the stdio position past the newly written records, for the subsequent write_entry_to_disk
+    fseek(myfile, 0, SEEK_END);
+}
+
+void DiskVP::write_entries_from_file(const std::filesystem::path &raw) {
+    unsigned long len;
+    mmap_file fd;
+    auto rows = (float*)mmapFile(raw.string(), &len, &fd);
+    if (!rows)
+        throw std::runtime_error("ERROR: cannot map "+raw.string());
+#ifndef _MSC_VER
+    madvise(rows, len, MADV_SEQUENTIAL);
+#endif
+    write_entries_to_disk(rows, len / (sizeof(float)*d));
+    mmapClose(rows, &fd);
+}
+
+std::vector<size_t> DiskVP::restruct_buffer(std::vector<char> &buffer, size_t n) const {
+    DiskVP sub(d, vptree, ker, blockade, doBalancedSorting);
+    sub.copy_format(*this);
+    sub.seed = seed ^ n;
+    sub.threads = threads;
+    sub.parallelGrain = parallelGrain;
+    sub.vpCandidates = vpCandidates;
+    sub.vpSamples = vpSamples;
+    sub.leafBucketSize = leafBucketSize;
+    sub.file = buffer.data();
+    sub.start_to_write = true;
+    sub.idx = n;
+    sub.index.resize(n);
+    std::iota(sub.index.begin(), sub.index.end(), 0);
+    if (sub.threads > 1) {
+        sub.parallel_restruct_tree(0, n-1);
+    } else {
+        sub.recursive_restruct_tree(0, n-1);
+    }
+    // The buffer is owned by the caller
+    sub.file = nullptr;
+    return std::move(sub.index);
+}
+
+void DiskVP::permute_in_place() {
+    const size_t recordSize = record_size();
+    std::vector<char> tmp(recordSize);
+    for (size_t start = 0, N = size(); start<N; start++) {
+        if (index[start] == start)
+            continue;
+        // Following the cycle starting from start: each position receives the record it should hold
+        memcpy(tmp.data(), getEntryPoint(start), recordSize);
+        size_t j = start;
+        while (true) {
+            size_t k = index[j];
+            index[j] = j;
+            if (k == start) {
+                memcpy(getEntryPoint(j), tmp.data(), recordSize);
+                break;
+            }
+            memcpy(getEntryPoint(j), getEntryPoint(k), recordSize);
+            j = k;
+        }
+    }
+}
+
+/**
+ * Appends to order the positions of the subtree rooted at pos, truncated at height h, in van Emde Boas order
+ */
+static void veb_order(const DiskVP& vp, size_t pos, size_t h, const std::vector<uint32_t>& height,
+                      const std::vector<size_t>& subtreeLast, std::vector<size_t>& order) {
+    constexpr uint64_t null = DiskVP::NO_CHILD;
+    auto node = vp.getEntryPoint(pos);
+    if (node->isLeaf) {
+        for (size_t i = pos; i<=subtreeLast[pos]; i++)
+            order.emplace_back(i);
+        return;
+    }
+    if (h == 1) {
+        order.emplace_back(pos);
+        return;
+    }
+    size_t top = (h+1)/2, bottom = h - top;
+    veb_order(vp, pos, top, height, subtreeLast, order);
+    // Roots of the bottom subtrees, being the descendants at depth top, from left to right
+    std::vector<size_t> frontier{pos};
+    for (size_t depth = 0; depth<top; depth++) {
+        std::vector<size_t> next;
+        for (size_t x : frontier) {
+            auto n = vp.getEntryPoint(x);
+            if (n->isLeaf)
+                continue;
+            if (n->leftChild != null)
+                next.emplace_back(n->leftChild);
+            if (n->rightChild != null)
+                next.emplace_back(n->rightChild);
+        }
+        frontier.swap(next);
+    }
+    for (size_t x : frontier)
+        veb_order(vp, x, bottom, height, subtreeLast, order);
+}
+
+void DiskVP::relayout_veb() {
+    finaliseFile();
+    if (is_narrow())
+        throw std::runtime_error("ERROR: files with 32-bit ids cannot be relaid out: rebuild them");
+    if (is_split())
+        throw std::runtime_error("ERROR: the records were split from the topology");
+    if ((!is_preorder()) || (idx == 0))
+        return;
+    constexpr uint64_t null = NO_CHILD;
+    const size_t n = idx;
+
+    // As each subtree spans a contiguous range in preorder, the children come after their parents
+    std::vector<size_t> subtreeLast(n, 0);
+    std::vector<bool> reachable(n, false);
+    std::stack<std::pair<size_t,size_t>> s;
+    s.emplace(0, n-1);
+    while (!s.empty()) {
+        auto [first, last] = s.top();
+        s.pop();
+        subtreeLast[first] = last;
+        reachable[first] = true;
+        auto node = getEntryPoint(first);
+        if (node->isLeaf)
+            continue;
+        if (node->leftChild != null)
+            s.emplace(node->leftChild, (node->rightChild != null) ? node->rightChild - 1 : last);
+        if (node->rightChild != null)
+            s.emplace(node->rightChild, last);
+    }
+    std::vector<uint32_t> height(n, 1);
+    for (size_t i = n; i-- > 0; ) {
+        auto node = getEntryPoint(i);
+        if ((!reachable[i]) || node->isLeaf)
+            continue;
+        if (node->leftChild != null)
+            height[i] = std::max(height[i], height[node->leftChild]+1);
+        if (node->rightChild != null)
+            height[i] = std::max(height[i], height[node->rightChild]+1);
+    }
+
+    std::vector<size_t> order;
+    order.reserve(n);
+    veb_order(*this, 0, height[0], height, subtreeLast, order);
+    // Positions no longer reachable after a compaction are kept at the end
+    std::vector<bool> placed(n, false);
+    for (size_t x : order)
+        placed[x] = true;
+    for (size_t i = 0; i<n; i++) {
+        if (!placed[i])
+            order.emplace_back(i);
     }
+    std::vector<size_t> newPos(n);
+    for (size_t i = 0; i<n; i++)
+        newPos[order[i]] = i;
+
+    // Rewriting the pointers while the records are still at their preorder positions
+    for (size_t i = 0; i<n; i++) {
+        if (!reachable[i])
+            continue;
+        auto node = getEntryPoint(i);
+        if (node->isLeaf) {
+            node->leftChild = subtreeLast[i] - i + 1;
+            node->rightChild = null;
+        } else {
+            if (node->leftChild != null)
+                node->leftChild = newPos[node->leftChild];
+            if (node->rightChild != null)
+                node->rightChild = newPos[node->rightChild];
+        }
+    }
+    index = std::move(order);
+    permute_in_place();
+    index.clear();
+
+    std::vector<size_t> indexMemory(idxFile ? std::vector<size_t>(idxFile, idxFile+n) : std::vector<size_t>(n, 0));
+    for (size_t i = 0; i<n; i++) {
+        auto id = getEntryPoint(i)->id;
+        if (id < n)
+            indexMemory[id] = i;
+    }
+    if (idxFile) {
+        memcpy(idxFile, indexMemory.data(), n*sizeof(size_t));
+    } else {
+        write_index_file(indexMemory);
+    }
+    flags |= DISKVP_FLAG_VEB_LAYOUT;
+    ((disk_vp_file_header*)file)->flags = flags;
+}
+
+void DiskVP::split_topology() {
+    finaliseFile();
+    if (is_narrow())
+        throw std::runtime_error("ERROR: files with 32-bit ids cannot be split: rebuild them");
+    if (is_split())
+        return;
+    const size_t n = idx;
+    auto header = file_header();
+    header.flags |= DISKVP_FLAG_SPLIT;
+
+    header.recordSize = align_up(sizeof(float)*d);
+    std::string vecFN = vptree.string()+"_vec";
+    FILE* vec = fopen(vecFN.c_str(), "w");
+    if (!vec)
+        throw std::runtime_error("ERROR: cannot write "+vecFN);
+    fwrite(&header, sizeof(disk_vp_file_header), 1, vec);
+    std::vector<char> slot(header.recordSize, 0);
+    for (size_t i = 0; i<n; i++) {
+        memcpy(slot.data(), getPTR(i), sizeof(float)*d);
+        fwrite(slot.data(), slot.size(), 1, vec);
+    }
+    fclose(vec);
+
+    header.recordSize = sizeof(disk_vp_node_header);
+    std::string topoFN = vptree.string()+"_topo";
+    FILE* topo = fopen(topoFN.c_str(), "w");
+    if (!topo)
+        throw std::runtime_error("ERROR: cannot write "+topoFN);
+    fwrite(&header, sizeof(disk_vp_file_header), 1, topo);
+    for (size_t i = 0; i<n; i++)
+        fwrite(getEntryPoint(i), sizeof(disk_vp_node_header), 1, topo);
+    fclose(topo);
+
+    // Replacing the sorted file with the topology, and reopening it as it was
+    bool actual = (idxFile != nullptr), tomb = (tombstones != nullptr);
+    closeSortedFile();
+    std::filesystem::rename(topoFN, vptree);
+    openSortedFile(actual);
+    if (tomb)
+        openTombstones();
+}
+
+void DiskVP::open_split_files() {
+    std::string vecFN = vptree.string()+"_vec";
+    vecFile = (char*) mmapFile(vecFN, &vecLen, &vecPtr);
+    if (!vecFile)
+        throw std::runtime_error("ERROR: CANNOT OPEN "+vecFN);
+    auto header = (const disk_vp_file_header*)vecFile;
+    if ((vecLen < sizeof(disk_vp_file_header)) || (memcmp(header->magic, DISKVP_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->d != d) || (header->count != idx))
+        throw std::runtime_error("ERROR: "+vecFN+" DOES NOT MATCH");
+    vectorStride = header->recordSize;
+    if ((vectorStride < sizeof(float)*d) || (vecLen < sizeof(disk_vp_file_header) + vectorStride*idx))
+        throw std::runtime_error("ERROR: LENGTH DOES NOT MATCH");
+    vectors = vecFile + sizeof(disk_vp_file_header);
+    load_topology(file + dataOffset, node_size());
+}
+
+void DiskVP::open_narrow_records() {
+    vectors = file + dataOffset + vectorOffset;
+    vectorStride = recordStride;
+    load_topology(file + dataOffset, recordStride);
+}
+
+void DiskVP::load_topology(const char *first, size_t stride) {
+    // Anonymous memory rounded to huge pages, so that the kernel can back it with them
+    constexpr size_t HUGE_PAGE = 2*1024*1024;
+    size_t len = std::max((size_t)1, sizeof(disk_vp_node_header)*idx);
+    topologyLen = (len + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    topology = (char*) mmap(nullptr, topologyLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (topology == MAP_FAILED) {
+        topology = nullptr;
+        throw std::runtime_error("ERROR: cannot allocate the topology");
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(topology, topologyLen, MADV_HUGEPAGE);
+#endif
+    if (!is_narrow()) {
+        memcpy(topology, first, sizeof(disk_vp_node_header)*idx);
+        return;
+    }
+    widen_nodes(first, stride, idx, (disk_vp_node_header*)topology);
+}
+
+void DiskVP::widen_nodes(const char *first, size_t stride, size_t n, disk_vp_node_header *out) {
+    constexpr uint32_t narrowNull = std::numeric_limits<uint32_t>::max();
+    for (size_t i = 0; i<n; i++, first += stride) {
+        disk_vp_narrow_node_header narrow;
+        memcpy(&narrow, first, sizeof(disk_vp_narrow_node_header));
+        out[i].id = (narrow.id == narrowNull) ? STRANDED_SLOT : narrow.id;
+        out[i].radius = narrow.radius;
+        out[i].isLeaf = narrow.isLeaf;
+        out[i].leftChild = (narrow.leftChild == narrowNull) ? NO_CHILD : narrow.leftChild;
+        out[i].rightChild = (narrow.rightChild == narrowNull) ? NO_CHILD : narrow.rightChild;
+    }
+}
+
+void DiskVP::openTombstones() {
+    std::string tombFN = vptree.string()+"_tomb";
+    size_t words = std::max((size_t)1, (idx + 63) / 64);
+    if (!std::filesystem::exists(tombFN)) {
+        int fd = open(tombFN.c_str(), O_RDWR | O_CREAT, (mode_t)0600);
+        if ((fd == -1) || (ftruncate(fd, words*sizeof(uint64_t)) != 0))
+            throw std::runtime_error("ERROR: cannot create "+tombFN);
+        close(fd);
+    }
+    tombstones = (uint64_t*)mmapFile(tombFN, &tombLen, &tombPtr);
+    if ((!tombstones) || (tombLen < words*sizeof(uint64_t)))
+        throw std::runtime_error("ERROR: LENGTH DOES NOT MATCH");
+    deadCount = 0;
+    for (size_t i = 0; i<words; i++)
+        deadCount += __builtin_popcountll(tombstones[i]);
+}
+
+bool DiskVP::erase(size_t id) {
+    if (!tombstones)
+        openTombstones();
+    if ((id >= idx) || isDeleted(id))
+        return false;
+    tombstones[id / 64] |= (1ULL << (id % 64));
+    deadCount++;
+    return true;
+}
+
+void DiskVP::quantize(VectorCodec codec) {
+    if (metric != METRIC_EUCLIDEAN)
+        throw std::runtime_error("ERROR: quantized distances are only available for the Euclidean metric");
+    QuantizedVectors::build(*this, vptree.string()+"_q", codec);
+}
+
+void DiskVP::openQuantized() {
+    if (metric != METRIC_EUCLIDEAN)
+        throw std::runtime_error("ERROR: quantized distances are only available for the Euclidean metric");
+    auto q = std::make_unique<QuantizedVectors>();
+    q->open(vptree.string()+"_q");
+    if ((q->d != d) || (q->count != idx))
+        throw std::runtime_error("ERROR: THE QUANTIZED FILE DOES NOT MATCH");
+    quantized = std::move(q);
+}
+
+void DiskVP::train_pq(unsigned int subspaces, size_t trainingSamples) {
+    if (metric != METRIC_EUCLIDEAN)
+        throw std::runtime_error("ERROR: PQ distances are only available for the Euclidean metric");
+    ProductQuantizer quantizer;
+    quantizer.train(*this, subspaces, trainingSamples);
+    quantizer.write(vptree.string()+"_pq");
+}
+
+void DiskVP::openPQ() {
+    if (metric != METRIC_EUCLIDEAN)
+        throw std::runtime_error("ERROR: PQ distances are only available for the Euclidean metric");
+    auto quantizer = std::make_unique<ProductQuantizer>();
+    quantizer->read(vptree.string()+"_pq");
+    if ((quantizer->d != d) || (quantizer->count != idx))
+        throw std::runtime_error("ERROR: THE PQ FILE DOES NOT MATCH");
+    pq = std::move(quantizer);
+}
+
+size_t DiskVP::compact(double threshold, size_t minSubtree) {
+    if ((!tombstones) || (deadCount == 0) || (idx == 0))
+        return 0;
+    if ((!is_preorder()) || is_split() || is_narrow())
+        throw std::runtime_error("ERROR: compaction requires the preorder layout of whole records, with 64-bit ids");
+    // deadBefore[i] is the number of deleted records within [0, i), so that each range is counted in O(1).
+    // The slots stranded by earlier compactions are not counted, as rebuilding their range would remove nothing
+    std::vector<size_t> deadBefore(idx+1, 0);
+    for (size_t i = 0; i<idx; i++) {
+        auto id = getEntryPoint(i)->id;
+        deadBefore[i+1] = deadBefore[i] + (((id != STRANDED_SLOT) && isDeleted(id)) ? 1 : 0);
+    }
+    size_t removed = 0;
+    const size_t recordSize = record_size();
+    constexpr uint64_t null = NO_CHILD;
+
+    // Subtree root position, last position of its range, and the parent's pointer to it (nullptr for the root)
+    std::stack<std::tuple<size_t, size_t, uint64_t*>> s;
+    s.emplace(0, idx-1, nullptr);
+    while (!s.empty()) {
+        auto [first, last, parentPtr] = s.top();
+        s.pop();
+        size_t total = last - first + 1;
+        size_t dead = deadBefore[last+1] - deadBefore[first];
+        auto root = getEntryPoint(first);
+        if ((total < minSubtree) || (((double)dead)/total <= threshold)) {
+            if (root->leftChild != null)
+                s.emplace(root->leftChild, (root->rightChild != null) ? root->rightChild - 1 : last, &root->leftChild);
+            if (root->rightChild != null)
+                s.emplace(root->rightChild, last, &root->rightChild);
+            continue;
+        }
+
+        // Rebuilding the subtree out of its live records
+        std::vector<char> buffer(dataOffset);
+        size_t n = 0;
+        for (size_t i = first; i<=last; i++) {
+            auto rec = (char*)getEntryPoint(i);
+            auto id = ((disk_vp_node_header*)rec)->id;
+            if (!isDeleted(id)) {
+                buffer.insert(buffer.end(), rec, rec+recordSize);
+                // Resetting the node, as the leaves are not updated by the restructuring
+                auto header = (disk_vp_node_header*)(buffer.data() + buffer.size() - recordSize);
+                header->radius = 0;
+                header->leftChild = header->rightChild = null;
+                header->isLeaf = false;
+                n++;
+            } else if (id != STRANDED_SLOT) {
+                removed++;
+                if (idxFile)
+                    idxFile[id] = NO_POSITION;
+            }
+        }
+        if (n > 0) {
+            auto order = restruct_buffer(buffer, n);
+            for (size_t i = 0; i<n; i++) {
+                auto dst = (char*)getEntryPoint(first+i);
+                memcpy(dst, buffer.data() + dataOffset + order[i]*recordSize, recordSize);
+                auto header = (disk_vp_node_header*)dst;
+                if (header->leftChild != null)
+                    header->leftChild += first;
+                if (header->rightChild != null)
+                    header->rightChild += first;
+                if (idxFile)
+                    idxFile[header->id] = first+i;
+            }
+        } else if (parentPtr) {
+            *parentPtr = null;
+        }
+        for (size_t i = first+n; i<=last; i++) {
+            auto header = getEntryPoint(i);
+            header->id = STRANDED_SLOT;
+            header->radius = 0;
+            header->leftChild = header->rightChild = null;
+        }
+    }
+    if (quantized && (removed > 0)) {
+        // The records moved: the codes are to follow them
+        auto codec = quantized->codec;
+        quantized.reset();
+        quantize(codec);
+        openQuantized();
+    }
+    if (pq && (removed > 0)) {
+        // Same codebooks, as the vectors did not change
+        pq->encode(*this);
+        pq->write(vptree.string()+"_pq");
+    }
+    return removed;
+}
+
+DiskVP::MaxDistanceSearch::MaxDistanceSearch(const DiskVP* vp, size_t id, double maxDistance) : maxDistance{maxDistance}, vp{vp}, nodesVisited{0} {
+    ptr = vp->getPTR(vp->position(id));
 }
 
-DiskVP::TopKSearch::TopKSearch(const DiskVP* vp, size_t id, size_t k) : vp{vp}, k{k} {
-    id = vp->idxFile[id];
-    ptr = vp->getPTR(id);
+DiskVP::MaxDistanceSearch::MaxDistanceSearch(const DiskVP* vp, float* id, double maxDistance) : maxDistance{maxDistance}, ptr{id}, vp{vp}, nodesVisited{0} {
 }
 
-DiskVP::TopKSearch::TopKSearch(const DiskVP* vp, float* id, size_t k) : vp{vp}, k{k}, ptr{id} {
+std::vector<DiskVP::HeapItem> DiskVP::MaxDistanceSearch::run() {
+    RangeCursor cursor(vp, ptr, maxDistance);
+    result.clear();
+    HeapItem item;
+    while (cursor.next(item))
+        result.emplace_back(item);
+    nodesVisited = cursor.nodesVisited;
+    if (sorted)
+        std::sort(result.begin(), result.end());
+    return result;
 }
 
-DiskVP::MaxDistanceSearch::MaxDistanceSearch(const DiskVP* vp, size_t id, double maxDistance) : vp{vp}, maxDistance{maxDistance} {
-    id = vp->idxFile[id];
-    ptr = vp->getPTR(id);
+DiskVP::RangeCursor DiskVP::lookUpNearsetTo(size_t id, double maxDistance) const {
+    return RangeCursor(this, getPTR(position(id)), maxDistance);
 }
 
-DiskVP::MaxDistanceSearch::MaxDistanceSearch(const DiskVP* vp, float* id, double maxDistance) : vp{vp}, maxDistance{maxDistance}, ptr{id} {
+DiskVP::RangeCursor DiskVP::lookUpNearsetTo(float* query, double maxDistance) const {
+    return RangeCursor(this, query, maxDistance);
 }
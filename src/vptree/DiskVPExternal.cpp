@@ -0,0 +1,223 @@
+/*
+ * DiskVPExternal.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vptree/DiskVP.h"
+#include <stxxl/vector>
+#include <stxxl/sorter>
+
+static_assert(sizeof(disk_vp_node_header) % sizeof(float) == 0, "node headers are stored as sequences of floats");
+static_assert(DISKVP_ALIGNMENT % sizeof(float) == 0, "records are stored as sequences of floats");
+
+// Each pending range is a vector on its own, and up to two ranges per tree level are pending at the same time:
+// therefore, each vector only caches two blocks of 2MB
+typedef stxxl::VECTOR_GENERATOR<float, 1, 2, 2*1024*1024>::result record_vector;
+
+/**
+ * Distance of an element from the vantage point; ties are broken by the position of the element within the
+ * range, so that the keys are all distinct, and the split is always of the expected size
+ */
+struct distance_key {
+    float dist;
+    uint64_t pos;
+};
+
+struct distance_key_compare {
+    bool operator()(const distance_key& l, const distance_key& r) const {
+        return (l.dist < r.dist) || ((l.dist == r.dist) && (l.pos < r.pos));
+    }
+    distance_key min_value() const {
+        return {-std::numeric_limits<float>::infinity(), 0};
+    }
+    distance_key max_value() const {
+        return {std::numeric_limits<float>::infinity(), std::numeric_limits<uint64_t>::max()};
+    }
+};
+
+/**
+ * Final position of each record, used for writing the _idx file sequentially in id order
+ */
+struct position_key {
+    uint64_t id;
+    uint64_t pos;
+};
+
+struct position_key_compare {
+    bool operator()(const position_key& l, const position_key& r) const {
+        return l.id < r.id;
+    }
+    position_key min_value() const {
+        return {std::numeric_limits<uint64_t>::min(), 0};
+    }
+    position_key max_value() const {
+        return {std::numeric_limits<uint64_t>::max(), 0};
+    }
+};
+
+typedef stxxl::sorter<position_key, position_key_compare> position_sorter;
+
+/**
+ * Range of records still to be restructured, which are going to be stored from position first onwards
+ */
+struct external_range {
+    std::unique_ptr<record_vector> records; ///<@ nullptr if the records are the ones from the original file
+    size_t first;
+    size_t count;
+};
+
+/**
+ * Restructures the n records within buffer, laid out as in the file (dataOffset bytes followed by the records),
+ * and writes them in preorder to b2, shifting the child pointers by the offset of the subtree root
+ */
+static void restruct_in_memory(const DiskVP& self, std::vector<char>& buffer, size_t n, size_t offset, DiskVP& b2, position_sorter& positions) {
+    auto order = self.restruct_buffer(buffer, n);
+    const size_t recordSize = self.record_size();
+    std::vector<char> record(recordSize);
+    for (size_t i = 0; i<n; i++) {
+        memcpy(record.data(), buffer.data() + self.dataOffset + order[i]*recordSize, recordSize);
+        auto header = (disk_vp_node_header*)record.data();
+        if (header->leftChild != DiskVP::NO_CHILD)
+            header->leftChild += offset;
+        if (header->rightChild != DiskVP::NO_CHILD)
+            header->rightChild += offset;
+        b2.write_record_to_disk(record.data());
+        positions.push(position_key{header->id, offset+i});
+    }
+}
+
+void DiskVP::restruct_index_external(DiskVP &b2, size_t memoryBudget) {
+    if (!start_to_write)
+        return;
+    finaliseFile();
+    b2.copy_format(*this);
+    const size_t recordSize = record_size();
+    const size_t stride = recordSize / sizeof(float);
+    // The recursion always stops in memory with at least two elements per range
+    memoryBudget = std::max(memoryBudget, 2*recordSize);
+    const size_t sorterMemory = std::max(memoryBudget / 4, (size_t)64*1024*1024);
+    // The original index is not required, as the records are moved rather than their offsets
+    index.clear();
+    index.shrink_to_fit();
+
+    position_sorter positions(position_key_compare(), sorterMemory);
+    std::stack<external_range> pending;
+    pending.push(external_range{nullptr, 0, idx});
+    std::vector<char> vantage(recordSize);
+    std::vector<float> record(stride);
+
+    while (!pending.empty()) {
+        external_range range = std::move(pending.top());
+        pending.pop();
+
+        // Sequential scan of all the records within the current range
+        auto scan = [&](const std::function<void(size_t, const char*)>& f) {
+            if (!range.records) {
+                for (size_t i = 0; i<range.count; i++)
+                    f(i, (const char*)getEntryPoint(i));
+            } else {
+                auto it = range.records->cbegin();
+                for (size_t i = 0; i<range.count; i++) {
+                    for (size_t j = 0; j<stride; j++, ++it)
+                        record[j] = *it;
+                    f(i, (const char*)record.data());
+                }
+            }
+        };
+
+        if ((range.count*recordSize <= memoryBudget) || (range.count <= leafBucketSize)) {
+            // Switching to the in-memory restructuring
+            std::vector<char> buffer(dataOffset + range.count*recordSize);
+            scan([&](size_t i, const char* rec) {
+                memcpy(buffer.data() + dataOffset + i*recordSize, rec, recordSize);
+            });
+            range.records.reset();
+            restruct_in_memory(*this, buffer, range.count, range.first, b2, positions);
+            continue;
+        }
+
+        // Choosing the vantage point at random, as for RANDOM_ROOT_UNBALANCED
+        SplitMix64 rng{seed ^ (range.first * 0xD1B54A32D192ED03ULL)};
+        std::uniform_int_distribution<size_t> uni(0, range.count - 1);
+        size_t root = uni(rng);
+        if (!range.records) {
+            memcpy(vantage.data(), getEntryPoint(root), recordSize);
+        } else {
+            const record_vector& records = *range.records;
+            for (size_t j = 0; j<stride; j++)
+                ((float*)vantage.data())[j] = records[root*stride+j];
+        }
+        auto vptr = (float*)(vantage.data()+vectorOffset);
+
+        // First pass: materialising the distances from the vantage point, and sorting them for the median
+        stxxl::VECTOR_GENERATOR<float, 1, 2>::result distances;
+        stxxl::sorter<distance_key, distance_key_compare> keys(distance_key_compare(), sorterMemory);
+        scan([&](size_t i, const char* rec) {
+            if (i != root) {
+                float dist = ker(d, vptr, (float*)(rec+vectorOffset));
+                distances.push_back(dist);
+                keys.push(distance_key{dist, i});
+            }
+        });
+        // Same split as recursive_restruct_tree: [first+1, rc-1] within the radius, and [rc, last] outside
+        size_t nLeft = (range.count - 1) / 2;
+        keys.sort();
+        for (size_t i = 1; i<nLeft; i++)
+            ++keys;
+        distance_key threshold = *keys;
+
+        auto header = (disk_vp_node_header*)vantage.data();
+        header->radius = threshold.dist;
+        header->leftChild = range.first + 1;
+        header->rightChild = range.first + 1 + nLeft;
+        b2.write_record_to_disk(vantage.data());
+        positions.push(position_key{header->id, range.first});
+
+        // Second pass: physically partitioning the records
+        auto left = std::make_unique<record_vector>();
+        auto right = std::make_unique<record_vector>();
+        auto dist = distances.cbegin();
+        distance_key_compare cmp;
+        scan([&](size_t i, const char* rec) {
+            if (i != root) {
+                auto& dst = cmp(threshold, distance_key{*dist, i}) ? *right : *left;
+                ++dist;
+                auto ptr = (const float*)rec;
+                for (size_t j = 0; j<stride; j++)
+                    dst.push_back(ptr[j]);
+            }
+        });
+        range.records.reset();
+
+        // Visiting the left subtree first, so that the output is written in preorder
+        pending.push(external_range{std::move(right), range.first + 1 + nLeft, range.count - 1 - nLeft});
+        pending.push(external_range{std::move(left), range.first + 1, nLeft});
+    }
+
+    // Writing the index sequentially, as the positions are now sorted by id
+    positions.sort();
+    std::string indexFN = vptree.string()+"_idx";
+    auto idxFile = fopen(indexFN.c_str(), "w");
+    while (!positions.empty()) {
+        size_t pos = (*positions).pos;
+        fwrite(&pos, sizeof(size_t), 1, idxFile);
+        ++positions;
+    }
+    fclose(idxFile);
+    b2.finaliseFile();
+}
@@ -0,0 +1,139 @@
+/*
+ * DiskVPReader.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vptree/DiskVPReader.h"
+
+DiskVPReader::DiskVPReader(unsigned int d, const std::filesystem::path &vptree,
+                           const std::function<float(size_t, float *, float *)> &ker, DiskVPMetric metric) :
+        d{d}, ker{ker}, nodes{nullptr}, nodeStride{0}, vectors{nullptr}, vectorStride{0}, count{0}, flags{0},
+        idxFile{nullptr}, tombstones{nullptr}, file{nullptr}, vecFile{nullptr}, tombFile{nullptr}, idxMap{nullptr},
+        fileLen{0}, vecLen{0}, tombLen{0}, idxLen{0} {
+    try {
+        file = mmapFileReadOnly(vptree.string(), &fileLen, &filePtr);
+        if (!file)
+            throw std::runtime_error("ERROR: CANNOT OPEN "+vptree.string());
+        auto base = (const char*)file;
+        auto header = (const disk_vp_file_header*)file;
+        if ((fileLen >= sizeof(disk_vp_file_header)) && (memcmp(header->magic, DISKVP_MAGIC, sizeof(header->magic)) == 0)) {
+            if ((header->version != DISKVP_FORMAT_VERSION) && (header->version != DISKVP_NARROW_VERSION))
+                throw std::runtime_error("ERROR: UNSUPPORTED FORMAT VERSION");
+            if (header->d != d)
+                throw std::runtime_error("ERROR: DIMENSIONS DO NOT MATCH");
+            if ((metric != METRIC_CUSTOM) && (header->metric != METRIC_CUSTOM) && (header->metric != metric))
+                throw std::runtime_error("ERROR: METRICS DO NOT MATCH");
+            flags = header->flags;
+            count = header->count;
+            const bool narrow = header->version == DISKVP_NARROW_VERSION;
+            const size_t vectorOffset = DiskVP::align_up(sizeof(disk_vp_node_header));
+            const size_t recordStride = vectorOffset + DiskVP::align_up(sizeof(float)*d);
+            const size_t nodeSize = narrow ? sizeof(disk_vp_narrow_node_header) : sizeof(disk_vp_node_header);
+            const size_t stride = (flags & DISKVP_FLAG_SPLIT) ? nodeSize : recordStride;
+            if ((header->recordSize != stride) || (fileLen < sizeof(disk_vp_file_header) + stride*count))
+                throw std::runtime_error("ERROR: LENGTH DOES NOT MATCH");
+            const char* first = base + sizeof(disk_vp_file_header);
+            if (flags & DISKVP_FLAG_SPLIT) {
+                std::string vecFN = vptree.string()+"_vec";
+                vecFile = mmapFileReadOnly(vecFN, &vecLen, &vecPtr);
+                if (!vecFile)
+                    throw std::runtime_error("ERROR: CANNOT OPEN "+vecFN);
+                auto vecHeader = (const disk_vp_file_header*)vecFile;
+                if ((vecLen < sizeof(disk_vp_file_header)) || (memcmp(vecHeader->magic, DISKVP_MAGIC, sizeof(vecHeader->magic)) != 0) ||
+                    (vecHeader->d != d) || (vecHeader->count != count))
+                    throw std::runtime_error("ERROR: "+vecFN+" DOES NOT MATCH");
+                vectorStride = vecHeader->recordSize;
+                if ((vectorStride < sizeof(float)*d) || (vecLen < sizeof(disk_vp_file_header) + vectorStride*count))
+                    throw std::runtime_error("ERROR: LENGTH DOES NOT MATCH");
+                vectors = (const char*)vecFile + sizeof(disk_vp_file_header);
+            } else {
+                vectors = first + vectorOffset;
+                vectorStride = recordStride;
+            }
+            if (narrow) {
+                narrowNodes.resize(count);
+                DiskVP::widen_nodes(first, stride, count, narrowNodes.data());
+                nodes = (const char*)narrowNodes.data();
+                nodeStride = sizeof(disk_vp_node_header);
+            } else {
+                nodes = first;
+                nodeStride = stride;
+            }
+        } else {
+            if ((fileLen < sizeof(unsigned int)) || (*((const unsigned int *) file) != d))
+                throw std::runtime_error("ERROR: DIMENSIONS DO NOT MATCH");
+            const char* first = base + sizeof(unsigned int);
+            const size_t recordStride = sizeof(disk_vp_narrow_node_header)+sizeof(float)*d;
+            count = (fileLen-sizeof(unsigned int))/recordStride;
+            narrowNodes.resize(count);
+            DiskVP::widen_nodes(first, recordStride, count, narrowNodes.data());
+            nodes = (const char*)narrowNodes.data();
+            nodeStride = sizeof(disk_vp_node_header);
+            vectors = first + sizeof(disk_vp_narrow_node_header);
+            vectorStride = recordStride;
+        }
+
+        std::string indexFN = vptree.string()+"_idx";
+        idxMap = mmapFileReadOnly(indexFN, &idxLen, &idxPtr);
+        if ((count > 0) && ((!idxMap) || (idxLen/sizeof(size_t) != count)))
+            throw std::runtime_error("ERROR: LENGTH DOES NOT MATCH");
+        idxFile = (const size_t*)idxMap;
+
+        std::string tombFN = vptree.string()+"_tomb";
+        if (std::filesystem::exists(tombFN)) {
+            tombFile = mmapFileReadOnly(tombFN, &tombLen, &tombPtr);
+            if ((!tombFile) || (tombLen < ((count + 63) / 64)*sizeof(uint64_t)))
+                throw std::runtime_error("ERROR: LENGTH DOES NOT MATCH");
+            tombstones = (const uint64_t*)tombFile;
+        }
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+DiskVPReader::~DiskVPReader() {
+    close();
+}
+
+void DiskVPReader::close() {
+    if (file)
+        mmapClose((void*)file, &filePtr);
+    if (vecFile)
+        mmapClose((void*)vecFile, &vecPtr);
+    if (idxMap)
+        mmapClose((void*)idxMap, &idxPtr);
+    if (tombFile)
+        mmapClose((void*)tombFile, &tombPtr);
+    file = vecFile = idxMap = tombFile = nullptr;
+}
+
+std::vector<DiskVP::HeapItem> DiskVPReader::topK(const float *query, size_t k) const {
+    TopKSearch search(this, (float*)query, k);
+    return search.run();
+}
+
+std::vector<DiskVP::HeapItem> DiskVPReader::range(const float *query, double maxDistance) const {
+    RangeCursor cursor(this, (float*)query, maxDistance);
+    std::vector<DiskVP::HeapItem> result;
+    DiskVP::HeapItem item;
+    while (cursor.next(item))
+        result.emplace_back(item);
+    std::sort(result.begin(), result.end());
+    return result;
+}
@@ -0,0 +1,177 @@
+/*
+ * KnnGraph.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vptree/KnnGraph.h"
+#include "WorkStealingPool.h"
+
+/**
+ * Graph file being written, mapped in memory
+ */
+struct KnnGraphBuilder::Output {
+    knn_graph_header* header;
+    uint64_t* ids;
+    float* dists;
+    size_t k;
+    unsigned long len;
+    mmap_file ptr;
+
+    Output(const std::filesystem::path& graph, size_t count, size_t k) : k{k} {
+        const size_t size = sizeof(knn_graph_header) + count*k*(sizeof(uint64_t) + sizeof(float));
+        {
+            std::ofstream file(graph, std::ios::binary | std::ios::trunc);
+            if (!file)
+                throw std::runtime_error("ERROR: CANNOT OPEN "+graph.string());
+        }
+        std::filesystem::resize_file(graph, size);
+        header = (knn_graph_header*)mmapFile(graph.string(), &len, &ptr);
+        if (!header)
+            throw std::runtime_error("ERROR: CANNOT OPEN "+graph.string());
+        memcpy(header->magic, DISKVP_KNN_MAGIC, sizeof(header->magic));
+        header->version = DISKVP_KNN_VERSION;
+        header->k = k;
+        header->count = count;
+        ids = (uint64_t*)(header+1);
+        dists = (float*)(ids + count*k);
+        std::fill(ids, ids + count*k, KnnGraph::NO_NEIGHBOUR);
+        std::fill(dists, dists + count*k, std::numeric_limits<float>::infinity());
+    }
+
+    ~Output() {
+        mmapClose(header, &ptr);
+    }
+};
+
+KnnGraphBuilder::KnnGraphBuilder(const DiskVP* vp, size_t k, size_t threads) :
+        vp{vp}, k{k}, threads{std::max((size_t)1, threads)} {
+    if (k == 0)
+        throw std::runtime_error("ERROR: THE GRAPH REQUIRES AT LEAST ONE NEIGHBOUR");
+}
+
+size_t KnnGraphBuilder::process(Output& out, size_t pos, size_t parent) {
+    auto entry = vp->getEntryPoint(pos);
+    if (vp->isDeleted(entry->id))
+        return 0;
+    float* ptr = vp->getPTR(pos);
+    // The element itself is always found, at distance 0
+    DiskVP::TopKSearch search(vp, ptr, k+1);
+    size_t computed = 0;
+    if (seedFromParent && (!vp->quantized) && (!vp->pq) && (parent != DiskVP::NO_CHILD)) {
+        // The parent and its neighbours are k+1 distinct elements: the (k+1)-th smallest of their distances
+        // bounds the one of the (k+1)-th nearest element
+        static thread_local std::vector<float> candidates;
+        candidates.clear();
+        auto parentEntry = vp->getEntryPoint(parent);
+        if (!vp->isDeleted(parentEntry->id))
+            candidates.emplace_back(vp->distance_to(parent, ptr));
+        for (uint64_t neighbour : std::span<const uint64_t>(out.ids + parentEntry->id*k, k)) {
+            if (neighbour != KnnGraph::NO_NEIGHBOUR)
+                candidates.emplace_back(vp->distance_to(vp->idxFile[neighbour], ptr));
+        }
+        computed += candidates.size();
+        if (candidates.size() == k+1)
+            search.tauBound = *std::max_element(candidates.begin(), candidates.end());
+    }
+    auto result = search.run();
+    computed += search.nodesVisited;
+
+    uint64_t* ids = out.ids + entry->id*k;
+    float* dists = out.dists + entry->id*k;
+    size_t j = 0;
+    for (const auto& item : result) {
+        if ((item.item == entry->id) || (j == k))
+            continue;
+        ids[j] = item.item;
+        dists[j] = item.dist;
+        j++;
+    }
+    return computed;
+}
+
+size_t KnnGraphBuilder::visit_sequential(Output& out, size_t pos, size_t last, size_t parent) {
+    size_t computed = 0;
+    // Position of each subtree root, the last position of the subtree, and the position of its parent
+    std::stack<std::tuple<size_t,size_t,size_t>> s;
+    s.emplace(pos, last, parent);
+    while (!s.empty()) {
+        auto [root_id, rootLast, rootParent] = s.top();
+        s.pop();
+        auto root = vp->getEntryPoint(root_id);
+        if (root->isLeaf) {
+            // The bucket entries share the parent of the bucket
+            for (size_t i = root_id, end = vp->bucket_last(root_id, root, rootLast); i<=end; i++)
+                computed += process(out, i, rootParent);
+            continue;
+        }
+        computed += process(out, root_id, rootParent);
+        if (root->rightChild != DiskVP::NO_CHILD)
+            s.emplace(root->rightChild, rootLast, root_id);
+        if (root->leftChild != DiskVP::NO_CHILD)
+            s.emplace(root->leftChild, (root->rightChild != DiskVP::NO_CHILD) ? root->rightChild-1 : rootLast, root_id);
+    }
+    return computed;
+}
+
+void KnnGraphBuilder::visit(WorkStealingPool& pool, Output& out, size_t pos, size_t last, size_t parent, size_t depth) {
+    auto root = vp->getEntryPoint(pos);
+    // Subtrees are split into tasks by depth, as the subtree sizes are not known within the van Emde Boas layout
+    if ((root->isLeaf) || ((((size_t)1) << depth) >= 8*threads)) {
+        distances += visit_sequential(out, pos, last, parent);
+        return;
+    }
+    distances += process(out, pos, parent);
+    WorkStealingPool::TaskGroup group;
+    if (root->leftChild != DiskVP::NO_CHILD) {
+        size_t leftLast = (root->rightChild != DiskVP::NO_CHILD) ? root->rightChild-1 : last;
+        pool.submit(group, [this, &pool, &out, root, leftLast, pos, depth]() {
+            visit(pool, out, root->leftChild, leftLast, pos, depth+1);
+        });
+    }
+    if (root->rightChild != DiskVP::NO_CHILD)
+        visit(pool, out, root->rightChild, last, pos, depth+1);
+    pool.wait(group);
+}
+
+void KnnGraphBuilder::build(const std::filesystem::path& graph) {
+    distances = 0;
+    Output out(graph, vp->size(), k);
+    if (vp->size() > 0) {
+        WorkStealingPool pool(threads);
+        visit(pool, out, 0, vp->size()-1, DiskVP::NO_CHILD, 0);
+    }
+    distanceComputations = distances;
+}
+
+KnnGraph::KnnGraph(const std::filesystem::path& graph) {
+    header = (const knn_graph_header*)mmapFileReadOnly(graph.string(), &len, &ptr);
+    if (!header)
+        throw std::runtime_error("ERROR: CANNOT OPEN "+graph.string());
+    if ((len < sizeof(knn_graph_header)) || (memcmp(header->magic, DISKVP_KNN_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != DISKVP_KNN_VERSION) ||
+        (len < sizeof(knn_graph_header) + header->count*header->k*(sizeof(uint64_t) + sizeof(float)))) {
+        mmapClose((void*)header, &ptr);
+        throw std::runtime_error("ERROR: "+graph.string()+" IS NOT A GRAPH FILE");
+    }
+    ids = (const uint64_t*)(header+1);
+    dists = (const float*)(ids + header->count*header->k);
+}
+
+KnnGraph::~KnnGraph() {
+    mmapClose((void*)header, &ptr);
+}
@@ -0,0 +1,297 @@
+/*
+ * LSMDiskVP.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vptree/LSMDiskVP.h"
+
+/**
+ * Forces the file (or directory) to the disk
+ */
+static bool sync_file(const std::filesystem::path& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+/**
+ * Replaces the content of the file with a value, so that a crash leaves either the old value or the new one
+ */
+static void replace_file(const std::filesystem::path& path, size_t value) {
+    std::string tmp = path.string()+".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f)
+        throw std::runtime_error("ERROR: CANNOT WRITE "+tmp);
+    bool ok = (fwrite(&value, sizeof(size_t), 1, f) == 1) && (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+    fclose(f);
+    if ((!ok) || (rename(tmp.c_str(), path.c_str()) != 0))
+        throw std::runtime_error("ERROR: CANNOT WRITE "+path.string());
+    // The rename itself is only durable once the directory is
+    auto dir = path.parent_path();
+    sync_file(dir.empty() ? "." : dir);
+}
+
+/**
+ * Value stored by replace_file
+ */
+static bool read_file(const std::filesystem::path& path, size_t& value) {
+    if (!std::filesystem::exists(path))
+        return false;
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+        throw std::runtime_error("ERROR: CANNOT READ "+path.string());
+    bool ok = fread(&value, sizeof(size_t), 1, f) == 1;
+    fclose(f);
+    if (!ok)
+        throw std::runtime_error("ERROR: CORRUPTED "+path.string());
+    return true;
+}
+
+LSMDiskVP::LSMDiskVP(unsigned int d, const std::filesystem::path &base, size_t mergeThreshold) :
+        d{d}, base{base}, mergeThreshold{mergeThreshold}, generation{0}, mainSize{0}, deltaLog{nullptr}, merging{false} {
+    read_file(base.string()+".generation", generation);
+    if (std::filesystem::exists(generationFile(generation))) {
+        main = std::make_unique<DiskVP>(d, generationFile(generation), squared_distance);
+        main->openSortedFile();
+        mainSize = main->size();
+    }
+    // The previous generation is only removed once the current one is recorded, so it may survive a crash
+    if (generation > 0) {
+        unlink(generationFile(generation-1).c_str());
+        unlink((generationFile(generation-1).string()+"_idx").c_str());
+    }
+    // A merge that did not complete is going to be restarted, unless its generation was already recorded
+    std::string frozenLog = base.string()+".delta.merging", target = frozenLog+".target";
+    size_t targetGeneration;
+    if (read_file(target, targetGeneration) && (targetGeneration <= generation)) {
+        unlink(frozenLog.c_str());
+        unlink(target.c_str());
+    }
+    replay(frozenLog, frozen);
+    if (frozen.empty())
+        unlink(target.c_str());
+    replay(base.string()+".delta", delta);
+    deltaLog = fopen((base.string()+".delta").c_str(), "a");
+    if (!deltaLog)
+        throw std::runtime_error("ERROR: CANNOT OPEN "+base.string()+".delta");
+    if (!frozen.empty()) {
+        merging = true;
+        runMerge(true);
+    }
+}
+
+LSMDiskVP::~LSMDiskVP() {
+    try {
+        waitForMerge();
+    } catch (...) {
+        // The frozen delta is still on the disk, and is merged again when reopening
+    }
+    if (deltaLog)
+        fclose(deltaLog);
+    if (main)
+        main->closeSortedFile();
+}
+
+std::filesystem::path LSMDiskVP::generationFile(size_t gen) const {
+    return base.string()+"."+std::to_string(gen);
+}
+
+void LSMDiskVP::replay(const std::filesystem::path &log, std::vector<float> &segment) {
+    if (!std::filesystem::exists(log))
+        return;
+    size_t n = std::filesystem::file_size(log) / (sizeof(float)*d);
+    segment.resize(n*d);
+    FILE* f = fopen(log.c_str(), "r");
+    segment.resize(fread(segment.data(), sizeof(float)*d, n, f)*d);
+    fclose(f);
+}
+
+size_t LSMDiskVP::insert(const float *vector) {
+    size_t id;
+    bool doMerge;
+    {
+        std::unique_lock<std::shared_mutex> guard(lock);
+        // Flushed before returning the id, so that the vector survives the crash of the process
+        if ((fwrite(vector, sizeof(float), d, deltaLog) != d) || (fflush(deltaLog) != 0))
+            throw std::runtime_error("ERROR: CANNOT APPEND TO "+base.string()+".delta");
+        delta.insert(delta.end(), vector, vector+d);
+        id = mainSize + (frozen.size() + delta.size())/d - 1;
+        // After a failed merge, the next one is only started by an explicit call, which reports the error
+        doMerge = (!merging) && (!mergeError) && (delta.size()/d >= mergeThreshold);
+    }
+    if (doMerge)
+        merge(true);
+    return id;
+}
+
+std::vector<DiskVP::HeapItem> LSMDiskVP::topK(float *query, size_t k) const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    std::priority_queue<DiskVP::HeapItem> heap;
+    auto offer = [&heap, k](const DiskVP::HeapItem& item) {
+        if (heap.size() < k) {
+            heap.push(item);
+        } else if (item.dist < heap.top().dist) {
+            heap.pop();
+            heap.push(item);
+        }
+    };
+    if (main) {
+        DiskVP::TopKSearch search(main.get(), query, k);
+        for (const auto& item : search.run())
+            offer(item);
+    }
+    // Brute force over the delta segments, whose ids follow the main tree's
+    size_t id = mainSize;
+    for (const auto* segment : {&frozen, &delta}) {
+        for (size_t i = 0, N = segment->size()/d; i<N; i++, id++)
+            offer(DiskVP::HeapItem{id, squared_distance(d, (float*)segment->data()+i*d, query)});
+    }
+    std::vector<DiskVP::HeapItem> result;
+    while (!heap.empty()) {
+        result.emplace_back(heap.top());
+        heap.pop();
+    }
+    std::reverse(result.begin(), result.end());
+    return result;
+}
+
+void LSMDiskVP::merge(bool background) {
+    {
+        std::unique_lock<std::shared_mutex> guard(lock);
+        rethrowMergeError();
+        if (merging)
+            return;
+        // A frozen delta left by a failed merge is merged again, before freezing the current one
+        if (frozen.empty()) {
+            if (delta.empty())
+                return;
+            // The target is recorded first, so that a crash can never leave a frozen delta without it
+            replace_file(base.string()+".delta.merging.target", generation+1);
+            // Freezing the current delta, and starting a new one for the subsequent insertions
+            frozen.swap(delta);
+            fclose(deltaLog);
+            std::filesystem::rename(base.string()+".delta", base.string()+".delta.merging");
+            deltaLog = fopen((base.string()+".delta").c_str(), "a");
+            if (!deltaLog)
+                throw std::runtime_error("ERROR: CANNOT OPEN "+base.string()+".delta");
+        }
+        merging = true;
+    }
+    runMerge(background);
+}
+
+void LSMDiskVP::runMerge(bool background) {
+    // On failure, the error is kept for the caller, and the frozen delta is retained for the next attempt
+    auto attempt = [this](bool keepError) {
+        try {
+            mergeFrozen();
+        } catch (...) {
+            std::unique_lock<std::shared_mutex> guard(lock);
+            merging = false;
+            if (!keepError)
+                throw;
+            mergeError = std::current_exception();
+        }
+    };
+    std::lock_guard<std::mutex> mergerGuard(mergerMutex);
+    if (merger.joinable())
+        merger.join();
+    if (background) {
+        merger = std::thread(attempt, true);
+    } else {
+        attempt(false);
+    }
+}
+
+void LSMDiskVP::rethrowMergeError() {
+    if (mergeError) {
+        auto error = mergeError;
+        mergeError = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void LSMDiskVP::mergeFrozen() {
+    // Neither main nor frozen are changed by other threads while merging, so they can be read without locking
+    auto next = generationFile(generation+1);
+    {
+        Builder b(d, next);
+        if (main) {
+            // Rewriting the main tree's vectors in id order, so that their ids are preserved
+            std::vector<float> chunk;
+            chunk.reserve(std::min(mainSize, (size_t)65536)*d);
+            for (size_t id = 0; id<mainSize; id++) {
+                auto ptr = main->getPTR(main->idxFile[id]);
+                chunk.insert(chunk.end(), ptr, ptr+d);
+                if (chunk.size() == chunk.capacity()) {
+                    b.write_entries_to_disk(chunk);
+                    chunk.clear();
+                }
+            }
+            b.write_entries_to_disk(chunk);
+        }
+        b.write_entries_to_disk(std::span<const float>(frozen.data(), frozen.size()));
+        b.build();
+    }
+    // The new generation shall be on the disk before being recorded
+    if ((!sync_file(next)) || (!sync_file(next.string()+"_idx")))
+        throw std::runtime_error("ERROR: CANNOT SYNC "+next.string());
+    auto tree = std::make_unique<DiskVP>(d, next, squared_distance);
+    tree->openSortedFile();
+
+    std::unique_lock<std::shared_mutex> guard(lock);
+    // Recording the new generation first: a crash before removing the frozen delta then only discards it
+    // when reopening, and a crash before removing the previous generation only leaves it behind
+    replace_file(base.string()+".generation", generation+1);
+    unlink((base.string()+".delta.merging").c_str());
+    unlink((base.string()+".delta.merging.target").c_str());
+    if (main) {
+        main->closeSortedFile();
+        unlink(generationFile(generation).c_str());
+        unlink((generationFile(generation).string()+"_idx").c_str());
+    }
+    main = std::move(tree);
+    mainSize = main->size();
+    frozen.clear();
+    generation++;
+    merging = false;
+}
+
+void LSMDiskVP::waitForMerge() {
+    {
+        std::lock_guard<std::mutex> mergerGuard(mergerMutex);
+        if (merger.joinable())
+            merger.join();
+    }
+    std::unique_lock<std::shared_mutex> guard(lock);
+    rethrowMergeError();
+}
+
+void LSMDiskVP::sync() {
+    std::unique_lock<std::shared_mutex> guard(lock);
+    if ((fflush(deltaLog) != 0) || (fsync(fileno(deltaLog)) != 0))
+        throw std::runtime_error("ERROR: CANNOT SYNC "+base.string()+".delta");
+}
+
+size_t LSMDiskVP::size() const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return mainSize + (frozen.size() + delta.size())/d;
+}
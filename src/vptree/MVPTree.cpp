@@ -0,0 +1,346 @@
+/*
+ * MVPTree.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vptree/MVPTree.h"
+#include <algorithm>
+#include <cmath>
+
+/**
+ * Elements being arranged into the tree: the build order is a permutation of the items, while the distances
+ * of each item are stored at the item's position
+ */
+struct MVPTree::BuildContext {
+    FILE* out;
+    uint64_t offset;
+    std::vector<uint32_t> ids;
+    std::vector<size_t> order;
+    std::vector<float> d1, d2;
+    std::vector<float> paths;   ///<@ pathLength distances per item
+
+    void write(const void* ptr, size_t len) {
+        fwrite(ptr, len, 1, out);
+        offset += len;
+    }
+
+    void pad() {
+        static const char zeros[8]{};
+        if (offset % 8)
+            write(zeros, 8 - (offset % 8));
+    }
+};
+
+float MVPTree::distance(uint32_t l, uint32_t r) const {
+    return storage->ker(storage->d, getVector(l), getVector(r));
+}
+
+void MVPTree::build() {
+    closeFile();
+    if (storage->size() > NONE)
+        throw std::runtime_error("ERROR: the MVP-tree stores 32-bit ids");
+    BuildContext ctx;
+    for (size_t id = 0, N = storage->size(); id<N; id++) {
+        if (!storage->isDeleted(id))
+            ctx.ids.emplace_back(id);
+    }
+    size_t n = ctx.ids.size();
+    ctx.order.resize(n);
+    for (size_t i = 0; i<n; i++)
+        ctx.order[i] = i;
+    ctx.d1.resize(n);
+    ctx.d2.resize(n);
+    ctx.paths.resize(n*pathLength);
+
+    ctx.out = fopen(mvptree.c_str(), "w");
+    if (!ctx.out)
+        throw std::runtime_error("ERROR: CANNOT WRITE "+mvptree.string());
+    mvp_file_header header{storage->d, m, leafCapacity, pathLength, NO_CHILD};
+    ctx.offset = 0;
+    ctx.write(&header, sizeof(mvp_file_header));
+    header.root = build(ctx, 0, n, 0);
+    // The root is only known after its subtrees were written
+    fseek(ctx.out, 0, SEEK_SET);
+    fwrite(&header, sizeof(mvp_file_header), 1, ctx.out);
+    fclose(ctx.out);
+}
+
+uint64_t MVPTree::build(BuildContext &ctx, size_t begin, size_t end, size_t depthPath) {
+    if (begin == end)
+        return NO_CHILD;
+    auto& order = ctx.order;
+    mvp_node_header header;
+    memset(&header, 0, sizeof(mvp_node_header));
+
+    // The first vantage point is chosen at random, the second one is the farthest element from it
+    SplitMix64 rng{seed ^ (begin * 0xD1B54A32D192ED03ULL)};
+    std::uniform_int_distribution<size_t> uni(begin, end-1);
+    std::swap(order[begin], order[uni(rng)]);
+    header.vp1 = ctx.ids[order[begin]];
+    header.vp2 = NONE;
+    begin++;
+    for (size_t i = begin; i<end; i++)
+        ctx.d1[order[i]] = distance(header.vp1, ctx.ids[order[i]]);
+    if (begin < end) {
+        auto farthest = std::max_element(order.begin()+begin, order.begin()+end, [&ctx](size_t l, size_t r) {
+            return ctx.d1[l] < ctx.d1[r];
+        });
+        std::swap(order[begin], *farthest);
+        header.vp2 = ctx.ids[order[begin]];
+        begin++;
+        for (size_t i = begin; i<end; i++)
+            ctx.d2[order[i]] = distance(header.vp2, ctx.ids[order[i]]);
+    }
+    size_t n = end - begin;
+
+    if (n <= leafCapacity) {
+        header.isLeaf = 1;
+        header.count = n;
+        header.pathCount = std::min(depthPath, (size_t)pathLength);
+        uint64_t offset = ctx.offset;
+        ctx.write(&header, sizeof(mvp_node_header));
+        for (size_t i = begin; i<end; i++) {
+            size_t item = order[i];
+            mvp_leaf_entry entry{ctx.ids[item], ctx.d1[item], ctx.d2[item]};
+            ctx.write(&entry, sizeof(mvp_leaf_entry));
+            ctx.write(ctx.paths.data() + item*pathLength, header.pathCount*sizeof(float));
+        }
+        ctx.pad();
+        return offset;
+    }
+
+    // Both distances are recorded within the path of the elements below, as long as there is room for them
+    for (size_t i = begin; i<end; i++) {
+        size_t item = order[i];
+        if (depthPath < pathLength)
+            ctx.paths[item*pathLength+depthPath] = ctx.d1[item];
+        if (depthPath+1 < pathLength)
+            ctx.paths[item*pathLength+depthPath+1] = ctx.d2[item];
+    }
+
+    // Partitioning into m groups by d1, and each group into m further groups by d2. Each cut is the largest
+    // distance within its group: as ties might span two groups, the group intervals are closed
+    auto byDistance = [](const std::vector<float>& dist) {
+        return [&dist](size_t l, size_t r) {
+            return (dist[l] < dist[r]) || ((dist[l] == dist[r]) && (l < r));
+        };
+    };
+    std::vector<float> cuts(m*m - 1, 0.0);
+    std::vector<std::pair<size_t,size_t>> groups;
+    std::sort(order.begin()+begin, order.begin()+end, byDistance(ctx.d1));
+    for (size_t i = 0; i<m; i++) {
+        size_t gb = begin + (n*i)/m, ge = begin + (n*(i+1))/m;
+        if (i < m-1)
+            cuts[i] = (ge > gb) ? ctx.d1[order[ge-1]] : ((i > 0) ? cuts[i-1] : 0);
+        std::sort(order.begin()+gb, order.begin()+ge, byDistance(ctx.d2));
+        float* cuts2 = cuts.data() + (m-1) + i*(m-1);
+        for (size_t j = 0; j<m; j++) {
+            size_t sb = gb + ((ge-gb)*j)/m, se = gb + ((ge-gb)*(j+1))/m;
+            if (j < m-1)
+                cuts2[j] = (se > sb) ? ctx.d2[order[se-1]] : ((j > 0) ? cuts2[j-1] : 0);
+            groups.emplace_back(sb, se);
+        }
+    }
+
+    std::vector<uint64_t> children;
+    children.reserve(m*m);
+    for (const auto& [sb, se] : groups)
+        children.emplace_back(build(ctx, sb, se, depthPath+2));
+
+    uint64_t offset = ctx.offset;
+    ctx.write(&header, sizeof(mvp_node_header));
+    ctx.write(children.data(), children.size()*sizeof(uint64_t));
+    ctx.write(cuts.data(), cuts.size()*sizeof(float));
+    ctx.pad();
+    return offset;
+}
+
+void MVPTree::openFile() {
+    closeFile();
+    file = (char*) mmapFile(mvptree.string(), &mmapfilelen, &fileptr);
+    if ((!file) || (mmapfilelen < sizeof(mvp_file_header)))
+        throw std::runtime_error("ERROR: CANNOT OPEN "+mvptree.string());
+    auto header = (const mvp_file_header*)file;
+    if (header->d != storage->d)
+        throw std::runtime_error("ERROR: DIMENSIONS DO NOT MATCH");
+    m = header->m;
+    leafCapacity = header->leafCapacity;
+    pathLength = header->pathLength;
+    root = header->root;
+}
+
+/**
+ * Lower bound to the distance between the query and any element within the child (i, j), given the query's
+ * distances dq1 and dq2 from the two vantage points
+ */
+static inline float child_lower_bound(const float* cuts, size_t m, size_t i, size_t j, float dq1, float dq2) {
+    const float* cuts2 = cuts + (m-1) + i*(m-1);
+    float lo1 = (i > 0) ? cuts[i-1] : 0, hi1 = (i < m-1) ? cuts[i] : std::numeric_limits<float>::infinity();
+    float lo2 = (j > 0) ? cuts2[j-1] : 0, hi2 = (j < m-1) ? cuts2[j] : std::numeric_limits<float>::infinity();
+    return std::max({0.0f, lo1-dq1, dq1-hi1, lo2-dq2, dq2-hi2});
+}
+
+/**
+ * Whether the leaf entry might be within radius from the query, according to the triangle inequality over the
+ * leaf's vantage points and the path ones
+ */
+static inline bool entry_might_match(const mvp_node_header* node, const mvp_leaf_entry* entry, float dq1, float dq2,
+                                     const std::vector<float>& queryPath, float radius) {
+    if (std::abs(dq1 - entry->d1) > radius)
+        return false;
+    if ((node->vp2 != MVPTree::NONE) && (std::abs(dq2 - entry->d2) > radius))
+        return false;
+    auto path = (const float*)(entry + 1);
+    for (size_t l = 0; l<node->pathCount; l++) {
+        if (std::abs(queryPath[l] - path[l]) > radius)
+            return false;
+    }
+    return true;
+}
+
+MVPTree::TopKSearch::TopKSearch(const MVPTree *tree, float *ptr, size_t k) : ptr{ptr}, tree{tree}, k{k},
+                                                                            tau{std::numeric_limits<float>::max()},
+                                                                            queryPath(tree->pathLength),
+                                                                            distanceComputations{0} {
+}
+
+void MVPTree::TopKSearch::offer(uint32_t id, float dist) {
+    if (tree->storage->isDeleted(id))
+        return;
+    if (heap_.size() < k) {
+        heap_.push(DiskVP::HeapItem{id, dist});
+    } else if (dist < heap_.top().dist) {
+        heap_.pop();
+        heap_.push(DiskVP::HeapItem{id, dist});
+    }
+    if (heap_.size() == k)
+        tau = heap_.top().dist;
+}
+
+void MVPTree::TopKSearch::visit(uint64_t offset, size_t depthPath) {
+    auto node = tree->getNode(offset);
+    auto ker = [this](uint32_t id) {
+        distanceComputations++;
+        return tree->storage->ker(tree->storage->d, tree->getVector(id), ptr);
+    };
+    float dq1 = ker(node->vp1);
+    offer(node->vp1, dq1);
+    float dq2 = 0;
+    if (node->vp2 != NONE) {
+        dq2 = ker(node->vp2);
+        offer(node->vp2, dq2);
+    }
+
+    if (node->isLeaf) {
+        for (size_t i = 0; i<node->count; i++) {
+            auto entry = tree->getEntry(node, i);
+            if (entry_might_match(node, entry, dq1, dq2, queryPath, tau))
+                offer(entry->id, ker(entry->id));
+        }
+        return;
+    }
+
+    if (depthPath < tree->pathLength)
+        queryPath[depthPath] = dq1;
+    if (depthPath+1 < tree->pathLength)
+        queryPath[depthPath+1] = dq2;
+    // Visiting the closest children first, so that tau shrinks as early as possible
+    const size_t m = tree->m;
+    auto children = tree->getChildren(node);
+    auto cuts = tree->getCuts(node);
+    std::vector<std::pair<float, uint64_t>> candidates;
+    for (size_t i = 0; i<m; i++) {
+        for (size_t j = 0; j<m; j++) {
+            if (children[i*m+j] == NO_CHILD)
+                continue;
+            float lb = child_lower_bound(cuts, m, i, j, dq1, dq2);
+            if (lb <= tau)
+                candidates.emplace_back(lb, children[i*m+j]);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (const auto& [lb, child] : candidates) {
+        if (lb > tau)
+            break;
+        visit(child, depthPath+2);
+    }
+}
+
+std::vector<DiskVP::HeapItem> MVPTree::TopKSearch::run() {
+    distanceComputations = 0;
+    tau = std::numeric_limits<float>::max();
+    if (tree->root != NO_CHILD)
+        visit(tree->root, 0);
+    std::vector<DiskVP::HeapItem> result;
+    while (!heap_.empty()) {
+        result.emplace_back(heap_.top());
+        heap_.pop();
+    }
+    std::reverse(result.begin(), result.end());
+    return result;
+}
+
+MVPTree::MaxDistanceSearch::MaxDistanceSearch(const MVPTree *tree, float *ptr, double maxDistance) :
+        maxDistance{maxDistance}, ptr{ptr}, tree{tree}, queryPath(tree->pathLength), distanceComputations{0} {
+}
+
+void MVPTree::MaxDistanceSearch::visit(uint64_t offset, size_t depthPath) {
+    auto node = tree->getNode(offset);
+    const float radius = maxDistance;
+    auto check = [this, radius](uint32_t id) {
+        distanceComputations++;
+        float dist = tree->storage->ker(tree->storage->d, tree->getVector(id), ptr);
+        if ((dist <= radius) && (!tree->storage->isDeleted(id)))
+            result.emplace_back(DiskVP::HeapItem{id, dist});
+        return dist;
+    };
+    float dq1 = check(node->vp1);
+    float dq2 = (node->vp2 != NONE) ? check(node->vp2) : 0;
+
+    if (node->isLeaf) {
+        for (size_t i = 0; i<node->count; i++) {
+            auto entry = tree->getEntry(node, i);
+            if (entry_might_match(node, entry, dq1, dq2, queryPath, radius))
+                check(entry->id);
+        }
+        return;
+    }
+
+    if (depthPath < tree->pathLength)
+        queryPath[depthPath] = dq1;
+    if (depthPath+1 < tree->pathLength)
+        queryPath[depthPath+1] = dq2;
+    const size_t m = tree->m;
+    auto children = tree->getChildren(node);
+    auto cuts = tree->getCuts(node);
+    for (size_t i = 0; i<m; i++) {
+        for (size_t j = 0; j<m; j++) {
+            if ((children[i*m+j] != NO_CHILD) && (child_lower_bound(cuts, m, i, j, dq1, dq2) <= radius))
+                visit(children[i*m+j], depthPath+2);
+        }
+    }
+}
+
+std::vector<DiskVP::HeapItem> MVPTree::MaxDistanceSearch::run() {
+    distanceComputations = 0;
+    result.clear();
+    if (tree->root != NO_CHILD)
+        visit(tree->root, 0);
+    std::sort(result.begin(), result.end());
+    return result;
+}
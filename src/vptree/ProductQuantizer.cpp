@@ -0,0 +1,190 @@
+/*
+ * ProductQuantizer.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vptree/ProductQuantizer.h"
+#include "vptree/DiskVP.h"
+#include "WorkStealingPool.h"
+#include <cstring>
+
+void ProductQuantizer::set_subspaces(unsigned int d, unsigned int subspaces) {
+    if ((subspaces == 0) || (subspaces > d))
+        throw std::runtime_error("ERROR: THE SUBSPACES SHALL BE BETWEEN 1 AND THE DIMENSION");
+    this->d = d;
+    this->subspaces = subspaces;
+    // Spreading the remainder across the subspaces, so that their sizes differ by one at most
+    begin.resize(subspaces+1);
+    for (size_t m = 0; m<=subspaces; m++)
+        begin[m] = m*d/subspaces;
+}
+
+uint8_t ProductQuantizer::nearest(size_t m, const float* v) const {
+    const size_t dsub = begin[m+1]-begin[m];
+    const float* c = centroids.data() + DISKVP_PQ_CENTROIDS*begin[m];
+    float best = std::numeric_limits<float>::max();
+    uint8_t arg = 0;
+    for (size_t j = 0; j<DISKVP_PQ_CENTROIDS; j++, c += dsub) {
+        float s = 0;
+        for (size_t i = 0; i<dsub; i++) {
+            float f = c[i] - v[i];
+            s += f*f;
+        }
+        if (s < best) {
+            best = s;
+            arg = j;
+        }
+    }
+    return arg;
+}
+
+void ProductQuantizer::train(const DiskVP &vp, unsigned int subspaces, size_t trainingSamples, size_t iterations) {
+    set_subspaces(vp.d, subspaces);
+    const size_t n = vp.size();
+    if (n == 0)
+        throw std::runtime_error("ERROR: NO VECTORS TO TRAIN ON");
+
+    // Partial Fisher-Yates shuffle of the positions, so that the samples are distinct
+    SplitMix64 rng{vp.seed};
+    std::vector<size_t> positions(n);
+    for (size_t i = 0; i<n; i++)
+        positions[i] = i;
+    const size_t samples = std::min(std::max(trainingSamples, (size_t)DISKVP_PQ_CENTROIDS), n);
+    for (size_t i = 0; i<samples; i++)
+        std::swap(positions[i], positions[i + rng() % (n-i)]);
+    positions.resize(samples);
+    std::vector<float> training(samples*d);
+    for (size_t i = 0; i<samples; i++)
+        memcpy(training.data() + i*d, vp.getPTR(positions[i]), sizeof(float)*d);
+
+    // The subspaces are independent k-means problems
+    centroids.assign(DISKVP_PQ_CENTROIDS*d, 0);
+    WorkStealingPool pool(std::max((size_t)1, vp.threads));
+    WorkStealingPool::TaskGroup group;
+    for (size_t m = 0; m<subspaces; m++) {
+        pool.submit(group, [this, m, samples, iterations, &training]() {
+            const size_t dsub = begin[m+1]-begin[m];
+            float* c = centroids.data() + DISKVP_PQ_CENTROIDS*begin[m];
+            // Initialised on the first samples, which are already random
+            for (size_t j = 0; j<DISKVP_PQ_CENTROIDS; j++)
+                memcpy(c + j*dsub, training.data() + (j % samples)*d + begin[m], sizeof(float)*dsub);
+            std::vector<uint8_t> assignment(samples);
+            std::vector<double> sum(DISKVP_PQ_CENTROIDS*dsub);
+            std::vector<size_t> size(DISKVP_PQ_CENTROIDS);
+            SplitMix64 reseed{m};
+            for (size_t it = 0; it<iterations; it++) {
+                for (size_t i = 0; i<samples; i++)
+                    assignment[i] = nearest(m, training.data() + i*d + begin[m]);
+                std::fill(sum.begin(), sum.end(), 0.0);
+                std::fill(size.begin(), size.end(), 0);
+                for (size_t i = 0; i<samples; i++) {
+                    const float* v = training.data() + i*d + begin[m];
+                    size[assignment[i]]++;
+                    for (size_t k = 0; k<dsub; k++)
+                        sum[assignment[i]*dsub+k] += v[k];
+                }
+                for (size_t j = 0; j<DISKVP_PQ_CENTROIDS; j++) {
+                    if (size[j] == 0) {
+                        // Empty clusters restart from a random sample
+                        memcpy(c + j*dsub, training.data() + (reseed() % samples)*d + begin[m], sizeof(float)*dsub);
+                    } else {
+                        for (size_t k = 0; k<dsub; k++)
+                            c[j*dsub+k] = sum[j*dsub+k] / size[j];
+                    }
+                }
+            }
+        });
+    }
+    pool.wait(group);
+    encode(vp);
+}
+
+void ProductQuantizer::encode(const DiskVP &vp) {
+    if (vp.d != d)
+        throw std::runtime_error("ERROR: DIMENSIONS DO NOT MATCH");
+    count = vp.size();
+    codes.assign(count*subspaces, 0);
+    constexpr size_t grain = 16384;
+    WorkStealingPool pool(std::max((size_t)1, vp.threads));
+    WorkStealingPool::TaskGroup group;
+    for (size_t first = 0; first<count; first += grain) {
+        pool.submit(group, [this, &vp, first]() {
+            for (size_t i = first, last = std::min(first+grain, count); i<last; i++) {
+                const float* v = vp.getPTR(i);
+                for (size_t m = 0; m<subspaces; m++)
+                    codes[i*subspaces+m] = nearest(m, v + begin[m]);
+            }
+        });
+    }
+    pool.wait(group);
+}
+
+void ProductQuantizer::write(const std::filesystem::path &out) const {
+    pq_file_header header;
+    memset(&header, 0, sizeof(pq_file_header));
+    memcpy(header.magic, DISKVP_PQ_MAGIC, sizeof(header.magic));
+    header.d = d;
+    header.subspaces = subspaces;
+    header.count = count;
+    header.codesOffset = sizeof(pq_file_header) + sizeof(float)*centroids.size();
+    FILE* f = fopen(out.c_str(), "w");
+    if (!f)
+        throw std::runtime_error("ERROR: cannot write "+out.string());
+    fwrite(&header, sizeof(pq_file_header), 1, f);
+    fwrite(centroids.data(), sizeof(float), centroids.size(), f);
+    fwrite(codes.data(), 1, codes.size(), f);
+    fclose(f);
+}
+
+void ProductQuantizer::read(const std::filesystem::path &in) {
+    FILE* f = fopen(in.c_str(), "r");
+    if (!f)
+        throw std::runtime_error("ERROR: CANNOT OPEN "+in.string());
+    pq_file_header header;
+    if ((fread(&header, sizeof(pq_file_header), 1, f) != 1) || (memcmp(header.magic, DISKVP_PQ_MAGIC, sizeof(header.magic)) != 0)) {
+        fclose(f);
+        throw std::runtime_error("ERROR: "+in.string()+" IS NOT A PQ FILE");
+    }
+    set_subspaces(header.d, header.subspaces);
+    count = header.count;
+    centroids.resize(DISKVP_PQ_CENTROIDS*d);
+    codes.resize(count*subspaces);
+    bool ok = (fread(centroids.data(), sizeof(float), centroids.size(), f) == centroids.size()) &&
+              (fread(codes.data(), 1, codes.size(), f) == codes.size());
+    fclose(f);
+    if (!ok)
+        throw std::runtime_error("ERROR: LENGTH DOES NOT MATCH");
+}
+
+void ProductQuantizer::adc_table(const float *query, std::vector<float> &table) const {
+    table.resize(DISKVP_PQ_CENTROIDS*subspaces);
+    float* t = table.data();
+    for (size_t m = 0; m<subspaces; m++) {
+        const size_t dsub = begin[m+1]-begin[m];
+        const float* c = centroids.data() + DISKVP_PQ_CENTROIDS*begin[m];
+        const float* q = query + begin[m];
+        for (size_t j = 0; j<DISKVP_PQ_CENTROIDS; j++, c += dsub) {
+            float s = 0;
+            for (size_t i = 0; i<dsub; i++) {
+                float f = c[i] - q[i];
+                s += f*f;
+            }
+            *t++ = s;
+        }
+    }
+}
@@ -0,0 +1,368 @@
+/*
+ * QuantizedVectors.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vptree/QuantizedVectors.h"
+#include "vptree/DiskVP.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANTIZED_AVX2
+#endif
+
+static inline uint32_t float_bits(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(float));
+    return x;
+}
+
+static inline float bits_float(uint32_t x) {
+    float f;
+    memcpy(&f, &x, sizeof(float));
+    return f;
+}
+
+/**
+ * Rounds to the nearest half, ties to even
+ */
+static uint16_t float_to_half(float f) {
+    uint32_t x = float_bits(f);
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mant = x & 0x7FFFFF;
+    if (((x >> 23) & 0xFF) == 0xFF)
+        return sign | 0x7C00 | (mant ? 0x200 : 0);
+    int32_t exp = (int32_t)((x >> 23) & 0xFF) - 127 + 15;
+    if (exp >= 31)
+        return sign | 0x7C00;
+    if (exp <= 0) {
+        // Subnormal half
+        if (exp < -10)
+            return sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1U << shift) - 1), half = 1U << (shift - 1);
+        if ((rem > half) || ((rem == half) && (h & 1)))
+            h++;
+        return sign | h;
+    }
+    uint32_t h = ((uint32_t)exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1FFF;
+    // A carry out of the mantissa correctly increments the exponent, possibly up to infinity
+    if ((rem > 0x1000) || ((rem == 0x1000) && (h & 1)))
+        h++;
+    return sign | h;
+}
+
+static inline float half_to_float(uint16_t h) {
+    uint32_t sign = ((uint32_t)h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+    if (exp == 0) {
+        if (mant == 0)
+            return bits_float(sign);
+        // Normalising the subnormal half
+        exp = 1;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+        mant &= 0x3FF;
+    } else if (exp == 31) {
+        return bits_float(sign | 0x7F800000 | (mant << 13));
+    }
+    return bits_float(sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+/**
+ * Rounds to the nearest bfloat16, ties to even
+ */
+static inline uint16_t float_to_bf16(float f) {
+    uint32_t x = float_bits(f);
+    if ((x & 0x7FFFFFFF) > 0x7F800000)
+        return (x >> 16) | 0x40;
+    x += 0x7FFF + ((x >> 16) & 1);
+    return x >> 16;
+}
+
+static inline float bf16_to_float(uint16_t h) {
+    return bits_float((uint32_t)h << 16);
+}
+
+// Portable kernels, written so that the compiler can vectorise them
+
+static float l2_fp16(const QuantizedVectors& q, const char* code, const float* query) {
+    auto c = (const uint16_t*)code;
+    float s = 0;
+    for (size_t i = 0; i<q.d; i++) {
+        float f = half_to_float(c[i]) - query[i];
+        s += f*f;
+    }
+    return std::sqrt(s);
+}
+
+static float l2_bf16(const QuantizedVectors& q, const char* code, const float* query) {
+    auto c = (const uint16_t*)code;
+    float s = 0;
+    for (size_t i = 0; i<q.d; i++) {
+        float f = bf16_to_float(c[i]) - query[i];
+        s += f*f;
+    }
+    return std::sqrt(s);
+}
+
+static float l2_int8(const QuantizedVectors& q, const char* code, const float* query) {
+    auto c = (const uint8_t*)code;
+    const float* minP = q.minP.data();
+    const float* scale = q.scale.data();
+    float s = 0;
+    for (size_t i = 0; i<q.d; i++) {
+        float f = minP[i] + c[i]*scale[i] - query[i];
+        s += f*f;
+    }
+    return std::sqrt(s);
+}
+
+#ifdef QUANTIZED_AVX2
+#define AVX2_TARGET __attribute__((target("avx2,fma,f16c")))
+
+AVX2_TARGET static inline float horizontal_sum(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v), hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+    return _mm_cvtss_f32(lo);
+}
+
+AVX2_TARGET static float l2_fp16_avx2(const QuantizedVectors& q, const char* code, const float* query) {
+    auto c = (const uint16_t*)code;
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i+8<=q.d; i+=8) {
+        __m256 v = _mm256_cvtph_ps(_mm_load_si128((const __m128i*)(c+i)));
+        __m256 f = _mm256_sub_ps(v, _mm256_loadu_ps(query+i));
+        acc = _mm256_fmadd_ps(f, f, acc);
+    }
+    float s = horizontal_sum(acc);
+    for (; i<q.d; i++) {
+        float f = half_to_float(c[i]) - query[i];
+        s += f*f;
+    }
+    return std::sqrt(s);
+}
+
+AVX2_TARGET static float l2_bf16_avx2(const QuantizedVectors& q, const char* code, const float* query) {
+    auto c = (const uint16_t*)code;
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i+8<=q.d; i+=8) {
+        __m256i w = _mm256_cvtepu16_epi32(_mm_load_si128((const __m128i*)(c+i)));
+        __m256 v = _mm256_castsi256_ps(_mm256_slli_epi32(w, 16));
+        __m256 f = _mm256_sub_ps(v, _mm256_loadu_ps(query+i));
+        acc = _mm256_fmadd_ps(f, f, acc);
+    }
+    float s = horizontal_sum(acc);
+    for (; i<q.d; i++) {
+        float f = bf16_to_float(c[i]) - query[i];
+        s += f*f;
+    }
+    return std::sqrt(s);
+}
+
+AVX2_TARGET static float l2_int8_avx2(const QuantizedVectors& q, const char* code, const float* query) {
+    auto c = (const uint8_t*)code;
+    const float* minP = q.minP.data();
+    const float* scale = q.scale.data();
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i+8<=q.d; i+=8) {
+        __m256i w = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(c+i)));
+        __m256 v = _mm256_fmadd_ps(_mm256_cvtepi32_ps(w), _mm256_loadu_ps(scale+i), _mm256_loadu_ps(minP+i));
+        __m256 f = _mm256_sub_ps(v, _mm256_loadu_ps(query+i));
+        acc = _mm256_fmadd_ps(f, f, acc);
+    }
+    float s = horizontal_sum(acc);
+    for (; i<q.d; i++) {
+        float f = minP[i] + c[i]*scale[i] - query[i];
+        s += f*f;
+    }
+    return std::sqrt(s);
+}
+#endif
+
+size_t QuantizedVectors::bytes_per_dimension(VectorCodec codec) {
+    switch (codec) {
+        case CODEC_FP32:
+            return sizeof(float);
+        case CODEC_FP16:
+        case CODEC_BF16:
+            return sizeof(uint16_t);
+        case CODEC_INT8:
+            return sizeof(uint8_t);
+    }
+    throw std::runtime_error("ERROR: UNKNOWN CODEC");
+}
+
+void QuantizedVectors::build(const DiskVP &vp, const std::filesystem::path &out, VectorCodec codec) {
+    if ((codec != CODEC_FP16) && (codec != CODEC_BF16) && (codec != CODEC_INT8))
+        throw std::runtime_error("ERROR: UNSUPPORTED CODEC");
+    const size_t d = vp.d, n = vp.size();
+    quantized_file_header header;
+    memset(&header, 0, sizeof(quantized_file_header));
+    memcpy(header.magic, DISKVP_QUANTIZED_MAGIC, sizeof(header.magic));
+    header.codec = codec;
+    header.d = d;
+    header.count = n;
+    header.codeSize = (d*bytes_per_dimension(codec) + DISKVP_CODE_ALIGNMENT - 1) / DISKVP_CODE_ALIGNMENT * DISKVP_CODE_ALIGNMENT;
+    size_t calibration = (codec == CODEC_INT8) ? 2*d*sizeof(float) : 0;
+    header.codesOffset = (sizeof(quantized_file_header) + calibration + DISKVP_CODE_ALIGNMENT - 1) / DISKVP_CODE_ALIGNMENT * DISKVP_CODE_ALIGNMENT;
+
+    // Per-dimension calibration: a whole pass over the vectors, as the codes are stored in the same order
+    std::vector<float> minP(d, std::numeric_limits<float>::max()), maxP(d, std::numeric_limits<float>::lowest()), scale(d, 0);
+    if (codec == CODEC_INT8) {
+        for (size_t i = 0; i<n; i++) {
+            const float* v = vp.getPTR(i);
+            for (size_t j = 0; j<d; j++) {
+                minP[j] = std::min(minP[j], v[j]);
+                maxP[j] = std::max(maxP[j], v[j]);
+            }
+        }
+        for (size_t j = 0; j<d; j++) {
+            if (n == 0)
+                minP[j] = maxP[j] = 0;
+            scale[j] = (maxP[j] - minP[j]) / 255.0f;
+        }
+    }
+
+    FILE* f = fopen(out.c_str(), "w");
+    if (!f)
+        throw std::runtime_error("ERROR: cannot write "+out.string());
+    std::vector<char> buffer(header.codesOffset, 0);
+    memcpy(buffer.data(), &header, sizeof(quantized_file_header));
+    if (codec == CODEC_INT8) {
+        memcpy(buffer.data() + sizeof(quantized_file_header), minP.data(), d*sizeof(float));
+        memcpy(buffer.data() + sizeof(quantized_file_header) + d*sizeof(float), scale.data(), d*sizeof(float));
+    }
+    fwrite(buffer.data(), buffer.size(), 1, f);
+
+    std::vector<char> code(header.codeSize);
+    for (size_t i = 0; i<n; i++) {
+        memset(code.data(), 0, code.size());
+        const float* v = vp.getPTR(i);
+        switch (codec) {
+            case CODEC_FP16:
+                for (size_t j = 0; j<d; j++)
+                    ((uint16_t*)code.data())[j] = float_to_half(v[j]);
+                break;
+            case CODEC_BF16:
+                for (size_t j = 0; j<d; j++)
+                    ((uint16_t*)code.data())[j] = float_to_bf16(v[j]);
+                break;
+            case CODEC_INT8:
+                for (size_t j = 0; j<d; j++) {
+                    float c = (scale[j] > 0) ? std::round((v[j] - minP[j]) / scale[j]) : 0;
+                    ((uint8_t*)code.data())[j] = (uint8_t)std::clamp(c, 0.0f, 255.0f);
+                }
+                break;
+            default:
+                break;
+        }
+        fwrite(code.data(), code.size(), 1, f);
+    }
+    fclose(f);
+}
+
+void QuantizedVectors::open(const std::filesystem::path &in) {
+    close();
+    file = (char*) mmapFile(in.string(), &len, &ptr);
+    if (!file)
+        throw std::runtime_error("ERROR: CANNOT OPEN "+in.string());
+    auto header = (const quantized_file_header*)file;
+    if ((len < sizeof(quantized_file_header)) || (memcmp(header->magic, DISKVP_QUANTIZED_MAGIC, sizeof(header->magic)) != 0))
+        throw std::runtime_error("ERROR: "+in.string()+" IS NOT A QUANTIZED FILE");
+    d = header->d;
+    codec = (VectorCodec)header->codec;
+    count = header->count;
+    codeSize = header->codeSize;
+    if (len < header->codesOffset + codeSize*count)
+        throw std::runtime_error("ERROR: LENGTH DOES NOT MATCH");
+    codes = file + header->codesOffset;
+    if (codec == CODEC_INT8) {
+        auto calibration = (const float*)(file + sizeof(quantized_file_header));
+        minP.assign(calibration, calibration + d);
+        scale.assign(calibration + d, calibration + 2*d);
+    }
+
+    bool avx2 = false;
+#ifdef QUANTIZED_AVX2
+    avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+#endif
+    switch (codec) {
+        case CODEC_FP16:
+            kernel = l2_fp16;
+#ifdef QUANTIZED_AVX2
+            if (avx2) kernel = l2_fp16_avx2;
+#endif
+            break;
+        case CODEC_BF16:
+            kernel = l2_bf16;
+#ifdef QUANTIZED_AVX2
+            if (avx2) kernel = l2_bf16_avx2;
+#endif
+            break;
+        case CODEC_INT8:
+            kernel = l2_int8;
+#ifdef QUANTIZED_AVX2
+            if (avx2) kernel = l2_int8_avx2;
+#endif
+            break;
+        default:
+            throw std::runtime_error("ERROR: UNSUPPORTED CODEC");
+    }
+}
+
+void QuantizedVectors::close() {
+    if (file)
+        mmapClose(file, &ptr);
+    file = nullptr;
+    codes = nullptr;
+}
+
+void QuantizedVectors::decode(size_t pos, float *out) const {
+    const char* code = codes + codeSize*pos;
+    for (size_t j = 0; j<d; j++) {
+        switch (codec) {
+            case CODEC_FP16:
+                out[j] = half_to_float(((const uint16_t*)code)[j]);
+                break;
+            case CODEC_BF16:
+                out[j] = bf16_to_float(((const uint16_t*)code)[j]);
+                break;
+            case CODEC_INT8:
+                out[j] = minP[j] + ((const uint8_t*)code)[j]*scale[j];
+                break;
+            default:
+                break;
+        }
+    }
+}
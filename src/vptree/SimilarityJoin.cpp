@@ -0,0 +1,195 @@
+/*
+ * SimilarityJoin.cpp
+ * This file is part of DiskVP
+ *
+ * Copyright (C) 2024 - Giacomo Bergami
+ *
+ * DiskVP is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * DiskVP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DiskVP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vptree/SimilarityJoin.h"
+#include "vptree/VectorBlock.h"
+#include "WorkStealingPool.h"
+
+void StxxlJoinSink::append(std::span<const JoinPair> chunk) {
+    for (const auto& pair : chunk)
+        pairs.push_back(pair);
+}
+
+static_assert(SimilarityJoin::MAX_BLOCK == VectorBlock::MAX_BLOCK, "the elements of a block are a VectorBlock");
+
+/**
+ * Elements of r traversing s together
+ */
+struct SimilarityJoin::Block : VectorBlock {
+    size_t pos[MAX_BLOCK];              ///<@ position of each element within r
+    uint64_t id[MAX_BLOCK];
+
+    /**
+     * The elements still alive among the ones in [first, first+n) of r
+     */
+    Block(const DiskVP* r, size_t first, size_t n) : VectorBlock(r->d) {
+        for (size_t i = first; i<first+n; i++) {
+            auto entry = r->getEntryPoint(i);
+            if (r->isDeleted(entry->id))
+                continue;
+            pos[count] = i;
+            id[count] = entry->id;
+            add(r->getPTR(i));
+        }
+        transpose();
+    }
+
+    /**
+     * Elements of the mask preceding position p of the same tree
+     */
+    inline uint64_t before(uint64_t mask, size_t p) const {
+        uint64_t result = 0;
+        for (uint64_t m = mask; m; m &= m-1) {
+            size_t q = __builtin_ctzll(m);
+            if (pos[q] < p)
+                result |= 1ULL << q;
+        }
+        return result;
+    }
+};
+
+/**
+ * Per-task state: the results not yet handed to the sink, and the distances computed so far
+ */
+struct SimilarityJoin::Context {
+    SimilarityJoin& join;
+    std::vector<JoinPair> buffer;
+    size_t distances{0};
+
+    explicit Context(SimilarityJoin& join) : join{join} {}
+
+    inline void emit(uint64_t left, uint64_t right, float dist) {
+        if (join.is_self_join() && (right < left))
+            std::swap(left, right);
+        buffer.emplace_back(JoinPair{left, right, dist});
+        if (buffer.size() >= join.bufferSize)
+            flush();
+    }
+
+    inline void flush() {
+        if (buffer.empty())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(join.sinkMutex);
+            join.sink->append(buffer);
+        }
+        join.found += buffer.size();
+        buffer.clear();
+    }
+
+    inline void finish() {
+        flush();
+        join.distances += distances;
+        distances = 0;
+    }
+};
+
+SimilarityJoin::SimilarityJoin(const DiskVP* r, const DiskVP* s, double maxDistance, size_t threads) :
+        r{r}, s{s}, maxDistance{maxDistance}, threads{std::max((size_t)1, threads)} {
+    if (r->d != s->d)
+        throw std::runtime_error("ERROR: DIMENSIONS DO NOT MATCH");
+}
+
+SimilarityJoin::SimilarityJoin(const DiskVP* r, double maxDistance, size_t threads) :
+        SimilarityJoin(r, r, maxDistance, threads) {
+}
+
+void SimilarityJoin::join_block(size_t first, size_t count, Context& ctx) {
+    Block block(r, first, count);
+    if ((block.count == 0) || (s->size() == 0))
+        return;
+    const bool self = is_self_join();
+    const bool preorder = s->is_preorder();
+    const uint64_t all = block.all();
+    // Position of each subtree root, the last position of the subtree, and the elements of the block visiting it
+    std::stack<std::tuple<size_t,size_t,uint64_t>> st;
+    st.emplace(0, s->size()-1, all);
+    while (!st.empty()) {
+        auto [pos, last, mask] = st.top();
+        st.pop();
+        // Within a self-join, each pair is generated by the element coming first
+        if (self && preorder)
+            mask = block.before(mask, last);
+        if (!mask)
+            continue;
+        auto root = s->getEntryPoint(pos);
+        if (root->isLeaf) {
+            for (size_t i = pos, end = s->bucket_last(pos, root, last); i<=end; i++) {
+                auto entry = s->getEntryPoint(i);
+                if (s->isDeleted(entry->id))
+                    continue;
+                uint64_t active = self ? block.before(mask, i) : mask;
+                if (!active)
+                    continue;
+                block.distances(s, s->getPTR(i), active);
+                for (uint64_t m = active; m; m &= m-1) {
+                    size_t q = __builtin_ctzll(m);
+                    if (block.dist[q] <= maxDistance)
+                        ctx.emit(block.id[q], entry->id, block.dist[q]);
+                }
+                ctx.distances += __builtin_popcountll(active);
+            }
+            continue;
+        }
+        double rootRadius = root->radius;
+        s->prefetch_children(root);
+        block.distances(s, s->getPTR(pos), mask);
+        ctx.distances += __builtin_popcountll(mask);
+        uint64_t emitting = s->isDeleted(root->id) ? 0 : (self ? block.before(mask, pos) : mask);
+        bool hasLeft = root->leftChild != DiskVP::NO_CHILD, hasRight = root->rightChild != DiskVP::NO_CHILD;
+        uint64_t left = 0, right = 0;
+        for (uint64_t m = mask; m; m &= m-1) {
+            size_t q = __builtin_ctzll(m);
+            float dist = block.dist[q];
+            if ((emitting & (1ULL << q)) && (dist <= maxDistance))
+                ctx.emit(block.id[q], root->id, dist);
+            // The ball around the element may intersect either side of the radius
+            if (hasLeft && (dist - maxDistance <= rootRadius))
+                left |= 1ULL << q;
+            if (hasRight && (dist + maxDistance >= rootRadius))
+                right |= 1ULL << q;
+        }
+        if (right)
+            st.emplace(root->rightChild, last, right);
+        if (left)
+            st.emplace(root->leftChild, hasRight ? root->rightChild-1 : last, left);
+    }
+}
+
+size_t SimilarityJoin::run(JoinSink& sink) {
+    this->sink = &sink;
+    distances = 0;
+    found = 0;
+    const size_t block = std::clamp(blockSize, (size_t)1, MAX_BLOCK);
+    WorkStealingPool pool(threads);
+    WorkStealingPool::TaskGroup group;
+    for (size_t first = 0; first<r->size(); first += block) {
+        pool.submit(group, [this, first, block]() {
+            Context ctx(*this);
+            join_block(first, std::min(block, r->size()-first), ctx);
+            ctx.finish();
+        });
+    }
+    pool.wait(group);
+    this->sink = nullptr;
+    distanceComputations = distances;
+    pairsFound = found;
+    return pairsFound;
+}